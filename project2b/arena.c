@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+
+/* every allocation is rounded up to keep the next one aligned */
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+
+
+
+/**
+ * Mallocs a block with size usable bytes.
+ */
+static ARENA_BLOCK *new_block( size_t size )
+{
+  ARENA_BLOCK *block;
+
+  block = (ARENA_BLOCK *)malloc(sizeof(ARENA_BLOCK) + size);
+  if( block == NULL )
+    return NULL;
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+
+
+/**
+ * Initializes the arena
+ *
+ * @param block_size the size of each block requested from malloc;
+ *        larger allocations get a block of their own size
+ * @return an initialized arena on success, NULL on error.
+ */
+ARENA *init_arena( size_t block_size )
+{
+  ARENA *arena;
+  assert( block_size > 0 );
+
+  arena = (ARENA *)malloc(sizeof(ARENA));
+  if( arena == NULL )
+    return NULL;
+  arena->first = new_block( block_size );
+  if( arena->first == NULL ) {
+    free( arena );
+    return NULL;
+  }
+  arena->current = arena->first;
+  arena->block_size = block_size;
+  return arena;
+}
+
+
+
+/**
+ * Deallocates the arena and every block it owns.
+ * @param arena a non-NULL, initialized arena
+ */
+void free_arena( ARENA *arena )
+{
+  ARENA_BLOCK *block;
+  ARENA_BLOCK *next;
+  assert( arena != NULL );
+
+  for( block = arena->first; block != NULL; block = next ) {
+    next = block->next;
+    free( block );
+  }
+  free( arena );
+}
+
+
+
+/**
+ * Allocates size bytes, aligned for any type, from the arena.
+ *
+ * @param arena an initialized arena
+ * @param size the number of bytes wanted
+ * @return the memory, or NULL if a new block could not be malloc'd
+ */
+void *arena_alloc( ARENA *arena, size_t size )
+{
+  assert( arena != NULL );
+  ARENA_BLOCK *block = arena->current;
+  void *mem;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  /* move down the chain (blocks left over from before a reset are
+   * empty) until one has room, adding a block at the end if needed */
+  while( block->size - block->used < size ) {
+    if( block->next == NULL ) {
+      block->next = new_block( size > arena->block_size ?
+			       size : arena->block_size );
+      if( block->next == NULL )
+	return NULL;
+    }
+    block = block->next;
+  }
+  arena->current = block;
+  mem = block->data + block->used;
+  block->used += size;
+  return mem;
+}
+
+
+
+/**
+ * Copies len bytes of string into the arena and null-terminates them.
+ *
+ * @param arena an initialized arena
+ * @param string the bytes to copy
+ * @param len the number of bytes to copy
+ * @return the copy, or NULL if the arena could not grow
+ */
+char *arena_strndup( ARENA *arena, const char *string, size_t len )
+{
+  char *copy = (char *)arena_alloc( arena, len + 1 );
+
+  if( copy == NULL )
+    return NULL;
+  memcpy( copy, string, len );
+  copy[len] = '\0';
+  return copy;
+}
+
+
+
+/**
+ * Releases every allocation made since the last reset.  The blocks
+ * stay attached to the arena and are reused by later allocations.
+ * @param arena an initialized arena
+ */
+void arena_reset( ARENA *arena )
+{
+  ARENA_BLOCK *block;
+  assert( arena != NULL );
+
+  for( block = arena->first; block != NULL; block = block->next )
+    block->used = 0;
+  arena->current = arena->first;
+}
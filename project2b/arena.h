@@ -0,0 +1,86 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+
+#include <stdlib.h>
+#include <stddef.h>
+
+
+
+/**
+ * One chunk of arena memory.  Blocks are chained and kept across
+ * resets so that a warmed-up arena does not call malloc at all.
+ */
+typedef struct arena_block {
+  struct arena_block *next;	/* next block in the chain */
+  size_t size;			/* usable bytes in data */
+  size_t used;			/* bytes handed out since the last reset */
+  _Alignas(max_align_t) char data[];	/* the memory handed out */
+} ARENA_BLOCK;
+
+
+
+/**
+ * Control structure for a bump allocator.  Everything allocated from
+ * the arena is released at once by arena_reset() or free_arena();
+ * there is no way to free a single allocation.
+ */
+typedef struct arena {
+  ARENA_BLOCK *first;		/* start of the block chain */
+  ARENA_BLOCK *current;		/* block allocations are served from */
+  size_t block_size;		/* default size of a new block */
+} ARENA;
+
+
+
+/**
+ * Initializes the arena
+ *
+ * @param block_size the size of each block requested from malloc;
+ *        larger allocations get a block of their own size
+ * @return an initialized arena on success, NULL on error.
+ */
+ARENA *init_arena( size_t block_size );
+
+
+
+/**
+ * Deallocates the arena and every block it owns.
+ * @param arena a non-NULL, initialized arena
+ */
+void free_arena( ARENA *arena );
+
+
+
+/**
+ * Allocates size bytes, aligned for any type, from the arena.
+ *
+ * @param arena an initialized arena
+ * @param size the number of bytes wanted
+ * @return the memory, or NULL if a new block could not be malloc'd
+ */
+void *arena_alloc( ARENA *arena, size_t size );
+
+
+
+/**
+ * Copies len bytes of string into the arena and null-terminates them.
+ *
+ * @param arena an initialized arena
+ * @param string the bytes to copy
+ * @param len the number of bytes to copy
+ * @return the copy, or NULL if the arena could not grow
+ */
+char *arena_strndup( ARENA *arena, const char *string, size_t len );
+
+
+
+/**
+ * Releases every allocation made since the last reset.  The blocks
+ * stay attached to the arena and are reused by later allocations.
+ * @param arena an initialized arena
+ */
+void arena_reset( ARENA *arena );
+
+
+#endif
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE		/* memrchr() */
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+
+
+
+/**
+ * Drops the oldest entry.
+ */
+static void drop_oldest( HISTORY *history )
+{
+  history->first++;
+  history->count--;
+}
+
+
+
+/**
+ * Makes room for need bytes at history->head, dropping the oldest entries
+ * and wrapping to the start of the ring as needed.  The bytes between the
+ * last line and the end of the ring are left unused when it wraps.
+ */
+static void make_room( HISTORY *history, size_t need )
+{
+  size_t tail;
+
+  while( history->count == (long)history->max_entries )
+    drop_oldest( history );
+  for( ;; ) {
+    if( history->count == 0 ) {
+      history->head = 0;
+      return;
+    }
+    tail = history->offsets[history->first % history->max_entries];
+    if( tail < history->head ) {
+      /* the lines sit in [tail, head) */
+      if( history->size - history->head >= need )
+	return;
+      if( tail >= need ) {
+	history->head = 0;
+	return;
+      }
+    }
+    else if( tail - history->head >= need )
+      return;			/* they wrap: [tail, size) and [0, head) */
+    drop_oldest( history );
+  }
+}
+
+
+
+/**
+ * Adds a line to the ring only.
+ */
+static long add_line( HISTORY *history, const char *line, size_t len )
+{
+  long number;
+
+  if( len + 1 > history->size )
+    return -1;
+  make_room( history, len + 1 );
+  memcpy( history->data + history->head, line, len );
+  history->data[history->head + len] = '\0';
+  number = history->first + history->count;
+  history->offsets[number % history->max_entries] = history->head;
+  history->head += len + 1;
+  history->count++;
+  return number;
+}
+
+
+
+/**
+ * Writes all of buf, across short writes.
+ *
+ * @return 0 on success, -1 on error with errno set
+ */
+static int write_all( int fd, const char *buf, size_t len )
+{
+  ssize_t n;
+
+  while( len > 0 ) {
+    n = write( fd, buf, len );
+    if( n == -1 ) {
+      if( errno == EINTR )
+	continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+
+/**
+ * Replaces the history file with the lines in the ring, through a
+ * temporary file renamed over it, and returns a descriptor of the new
+ * file opened for appending.  Returns -1 if it could not be rewritten.
+ */
+static int rewrite_file( HISTORY *history, const char *path )
+{
+  char *tmp = (char *)malloc( strlen(path) + 5 );
+  char *lines = (char *)malloc( history->size );
+  const char *line;
+  size_t len = 0;
+  size_t n;
+  long number;
+  int fd;
+
+  if( tmp == NULL || lines == NULL ) {
+    free( tmp );
+    free( lines );
+    return -1;
+  }
+  /* the lines with their NULs fit in the ring, so with '\n's they fit here */
+  for( number = history->first; number < history->first + history->count; number++ ) {
+    line = history_get( history, number );
+    n = strlen( line );
+    memcpy( lines + len, line, n );
+    lines[len + n] = '\n';
+    len += n + 1;
+  }
+  sprintf( tmp, "%s.tmp", path );
+  fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600 );
+  if( fd != -1 && (write_all(fd, lines, len) == -1 || rename(tmp, path) == -1) ) {
+    close( fd );
+    unlink( tmp );
+    fd = -1;
+  }
+  free( tmp );
+  free( lines );
+  return fd;
+}
+
+
+
+/**
+ * Initializes an empty history
+ *
+ * @param max_entries the number of lines kept
+ * @param size the bytes kept for all lines together, each with its
+ *        terminating NUL
+ * @return an initialized history on success, NULL on error.
+ */
+HISTORY *init_history( size_t max_entries, size_t size )
+{
+  HISTORY *history;
+  assert( max_entries > 0 && size > 0 );
+
+  history = (HISTORY *)malloc(sizeof(HISTORY));
+  if( history == NULL )
+    return NULL;
+  history->data = (char *)malloc( size );
+  history->offsets = (size_t *)malloc( sizeof(size_t) * max_entries );
+  if( history->data == NULL || history->offsets == NULL ) {
+    free( history->data );
+    free( history->offsets );
+    free( history );
+    return NULL;
+  }
+  history->size = size;
+  history->head = 0;
+  history->max_entries = max_entries;
+  history->first = 1;
+  history->count = 0;
+  history->fd = -1;
+  return history;
+}
+
+
+
+/**
+ * Deallocates the history and closes its file.
+ * @param history a non-NULL, initialized history
+ */
+void free_history( HISTORY *history )
+{
+  assert( history != NULL );
+  if( history->fd != -1 )
+    close( history->fd );
+  free( history->data );
+  free( history->offsets );
+  free( history );
+}
+
+
+
+/**
+ * Loads the lines of a history file into the ring and keeps the file
+ * open, so that every line added afterwards is appended to it.  The file
+ * is memory-mapped and only its last lines, as many as the ring holds,
+ * are read, so loading takes the same time however long the file has
+ * grown.  A file holding more than twice what the ring keeps is
+ * rewritten with just the kept lines.  A missing file is created.
+ *
+ * @param history an initialized, empty history
+ * @param path the history file
+ * @return 0 on success, -1 on error with errno set
+ */
+int history_load( HISTORY *history, const char *path )
+{
+  assert( history != NULL && history->count == 0 );
+  struct stat st;
+  const char *map;
+  const char *start;
+  const char *end;
+  const char *nl;
+  size_t kept = 0;
+  size_t lines = 0;
+  int fd;
+
+  fd = open( path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600 );
+  if( fd == -1 )
+    return -1;
+  if( fstat(fd, &st) == -1 ) {
+    close( fd );
+    return -1;
+  }
+  if( st.st_size == 0 ) {
+    history->fd = fd;
+    return 0;
+  }
+  map = (const char *)mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if( map == MAP_FAILED ) {
+    close( fd );
+    return -1;
+  }
+
+  /* walk back over the lines that fit in the ring, newest first */
+  end = map + st.st_size;
+  if( end[-1] == '\n' )
+    end--;
+  start = end;
+  while( start > map && lines < history->max_entries ) {
+    nl = (const char *)memrchr( map, '\n', start - map );
+    nl = nl != NULL ? nl + 1 : map;
+    if( kept + (start - nl) + 1 > history->size )
+      break;
+    kept += (start - nl) + 1;
+    lines++;
+    start = nl > map ? nl - 1 : map;
+  }
+  if( start > map )
+    start++;			/* past the '\n' of the newest line not kept */
+
+  /* then add them oldest first */
+  while( start < end ) {
+    nl = (const char *)memchr( start, '\n', end - start );
+    if( nl == NULL )
+      nl = end;
+    if( nl > start )
+      add_line( history, start, nl - start );
+    start = nl + 1;
+  }
+  munmap( (void *)map, st.st_size );
+
+  if( (size_t)st.st_size > 2 * kept ) {
+    close( fd );
+    fd = rewrite_file( history, path );
+    if( fd == -1 )
+      return -1;
+  }
+  history->fd = fd;
+  return 0;
+}
+
+
+
+/**
+ * Adds a line as the newest entry, dropping the oldest entries as needed,
+ * and appends it to the history file if there is one.  Lines that do not
+ * fit in the ring at all are not kept.
+ *
+ * @param history an initialized history
+ * @param line the line, without its '\n'
+ * @return the number of the new entry, or -1 if it was not kept
+ */
+long history_add( HISTORY *history, const char *line )
+{
+  assert( history != NULL );
+  size_t len = strlen( line );
+  long number = add_line( history, line, len );
+
+  /* one write per line, so concurrent shells do not interleave lines */
+  if( number != -1 && history->fd != -1 ) {
+    history->data[history->head - 1] = '\n';
+    write_all( history->fd, history->data + history->offsets[number % history->max_entries],
+	       len + 1 );
+    history->data[history->head - 1] = '\0';
+  }
+  return number;
+}
+
+
+
+/**
+ * @param history an initialized history
+ * @param number the number of an entry
+ * @return the line of that entry, or NULL if it is not in the ring.  The
+ *         string is only valid until the next history_add().
+ */
+const char *history_get( HISTORY *history, long number )
+{
+  assert( history != NULL );
+  if( number < history->first || number >= history->first + history->count )
+    return NULL;
+  return history->data + history->offsets[number % history->max_entries];
+}
+
+
+
+/**
+ * Searches the history from the newest entry back for a line that starts
+ * with prefix.
+ *
+ * @param history an initialized history
+ * @param prefix the start of the line
+ * @return the number of the newest matching entry, or -1 if there is none
+ */
+long history_find_prefix( HISTORY *history, const char *prefix )
+{
+  assert( history != NULL );
+  size_t len = strlen( prefix );
+  long number;
+
+  for( number = history->first + history->count - 1; number >= history->first; number-- ) {
+    if( strncmp(history_get(history, number), prefix, len) == 0 )
+      return number;
+  }
+  return -1;
+}
+
+
+
+/**
+ * @param history an initialized history
+ * @return the number of the newest entry, 0 if the history is empty
+ */
+long history_last( HISTORY *history )
+{
+  assert( history != NULL );
+  return history->first + history->count - 1;
+}
@@ -0,0 +1,107 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+
+#include <stdlib.h>
+
+
+
+/**
+ * Control structure for the command history.  The lines are kept as
+ * NUL-terminated strings one after another in a single ring buffer, so
+ * adding a line never allocates; the oldest lines are dropped to make
+ * room.  Entries are numbered from 1 in the order they were added, as
+ * in sh, and keep their number while they are in the ring.
+ */
+typedef struct history {
+  char *data;			/* ring of NUL-terminated lines */
+  size_t size;			/* size of data */
+  size_t head;			/* where the next line is written */
+  size_t *offsets;		/* offset in data of entry n, at n % max_entries */
+  size_t max_entries;		/* size of offsets */
+  long first;			/* number of the oldest entry */
+  long count;			/* entries in the ring */
+  int fd;			/* history file lines are appended to, or -1 */
+} HISTORY;
+
+
+
+/**
+ * Initializes an empty history
+ *
+ * @param max_entries the number of lines kept
+ * @param size the bytes kept for all lines together, each with its
+ *        terminating NUL
+ * @return an initialized history on success, NULL on error.
+ */
+HISTORY *init_history( size_t max_entries, size_t size );
+
+
+
+/**
+ * Deallocates the history and closes its file.
+ * @param history a non-NULL, initialized history
+ */
+void free_history( HISTORY *history );
+
+
+
+/**
+ * Loads the lines of a history file into the ring and keeps the file
+ * open, so that every line added afterwards is appended to it.  The file
+ * is memory-mapped and only its last lines, as many as the ring holds,
+ * are read, so loading takes the same time however long the file has
+ * grown.  A file holding more than twice what the ring keeps is
+ * rewritten with just the kept lines.  A missing file is created.
+ *
+ * @param history an initialized, empty history
+ * @param path the history file
+ * @return 0 on success, -1 on error with errno set
+ */
+int history_load( HISTORY *history, const char *path );
+
+
+
+/**
+ * Adds a line as the newest entry, dropping the oldest entries as needed,
+ * and appends it to the history file if there is one.  Lines that do not
+ * fit in the ring at all are not kept.
+ *
+ * @param history an initialized history
+ * @param line the line, without its '\n'
+ * @return the number of the new entry, or -1 if it was not kept
+ */
+long history_add( HISTORY *history, const char *line );
+
+
+
+/**
+ * @param history an initialized history
+ * @param number the number of an entry
+ * @return the line of that entry, or NULL if it is not in the ring.  The
+ *         string is only valid until the next history_add().
+ */
+const char *history_get( HISTORY *history, long number );
+
+
+
+/**
+ * Searches the history from the newest entry back for a line that starts
+ * with prefix.
+ *
+ * @param history an initialized history
+ * @param prefix the start of the line
+ * @return the number of the newest matching entry, or -1 if there is none
+ */
+long history_find_prefix( HISTORY *history, const char *prefix );
+
+
+
+/**
+ * @param history an initialized history
+ * @return the number of the newest entry, 0 if the history is empty
+ */
+long history_last( HISTORY *history );
+
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "jobs.h"
+
+
+/* the job table, ordered by job number */
+static JOB *jobs = NULL;
+
+
+
+
+/**
+ * Adds a new job to the table.
+ *
+ * @param command the command line, copied into the job
+ * @param maxprocs the number of processes the job will have
+ * @param background whether the job runs in the background
+ * @return the new job, or NULL if it could not be allocated
+ */
+JOB *job_create( const char *command, int maxprocs, int background )
+{
+  JOB *job;
+  JOB **link;
+  int id = 1;
+
+  assert( maxprocs > 0 );
+  job = (JOB *)malloc(sizeof(JOB));
+  if( job == NULL )
+    return NULL;
+  job->procs = (JOB_PROCESS *)malloc(sizeof(JOB_PROCESS) * maxprocs);
+  job->command = strdup( command );
+  if( job->procs == NULL || job->command == NULL ) {
+    free( job->procs );
+    free( job->command );
+    free( job );
+    return NULL;
+  }
+  job->pgid = 0;
+  job->background = background;
+  job->timeout = JOB_TIMEOUT_NONE;
+  job->nprocs = 0;
+  job->maxprocs = maxprocs;
+
+  /* number it one past the newest job, as sh does */
+  for( link = &jobs; *link != NULL; link = &(*link)->next )
+    id = (*link)->id + 1;
+  job->id = id;
+  job->next = NULL;
+  *link = job;
+  return job;
+}
+
+
+
+/**
+ * Records a started process of the job.  The first one becomes the
+ * process group leader.
+ *
+ * @param job a job from job_create()
+ * @param pid the process id
+ */
+void job_add_process( JOB *job, pid_t pid )
+{
+  assert( job != NULL && job->nprocs < job->maxprocs );
+
+  if( job->pgid == 0 )
+    job->pgid = pid;
+  job->procs[job->nprocs].pid = pid;
+  job->procs[job->nprocs].state = PROCESS_RUNNING;
+  job->procs[job->nprocs].status = 0;
+  clock_gettime( CLOCK_MONOTONIC, &job->procs[job->nprocs].started );
+  job->nprocs++;
+}
+
+
+
+/**
+ * Collects the status and resource usage of every child that exited,
+ * stopped or continued without blocking, and stores them in the job
+ * table.  The shell calls it when its signalfd reports SIGCHLD and
+ * before it looks at the states of a job.
+ */
+void job_reap_children( void )
+{
+  struct rusage usage;
+  pid_t pid;
+  int status;
+
+  while( (pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0 )
+    job_record_status( pid, status, &usage );
+}
+
+
+
+/**
+ * Stores one wait status in the table.  Statuses of processes that do
+ * not belong to a job are ignored.
+ *
+ * @param pid the process the status belongs to
+ * @param status the status from wait4()
+ * @param usage the resource usage from wait4(), kept once the process is done
+ */
+void job_record_status( pid_t pid, int status, const struct rusage *usage )
+{
+  JOB *job;
+  int i;
+
+  for( job = jobs; job != NULL; job = job->next ) {
+    for( i = 0; i < job->nprocs; i++ ) {
+      if( job->procs[i].pid != pid )
+	continue;
+      if( WIFSTOPPED(status) )
+	job->procs[i].state = PROCESS_STOPPED;
+      else if( WIFCONTINUED(status) )
+	job->procs[i].state = PROCESS_RUNNING;
+      else {
+	job->procs[i].status = status;
+	job->procs[i].usage = *usage;
+	clock_gettime( CLOCK_MONOTONIC, &job->procs[i].finished );
+	job->procs[i].state = PROCESS_DONE;
+      }
+      return;
+    }
+  }
+}
+
+
+
+/**
+ * @param job a job in the table
+ * @return 1 if every process of the job has terminated
+ */
+int job_is_done( JOB *job )
+{
+  int i;
+
+  for( i = 0; i < job->nprocs; i++ ) {
+    if( job->procs[i].state != PROCESS_DONE )
+      return 0;
+  }
+  return 1;
+}
+
+
+
+/**
+ * @param job a job in the table
+ * @return 1 if the job is not done and none of its processes is running
+ */
+int job_is_stopped( JOB *job )
+{
+  int stopped = 0;
+  int i;
+
+  for( i = 0; i < job->nprocs; i++ ) {
+    if( job->procs[i].state == PROCESS_RUNNING )
+      return 0;
+    if( job->procs[i].state == PROCESS_STOPPED )
+      stopped = 1;
+  }
+  return stopped;
+}
+
+
+
+/**
+ * Marks the stopped processes of the job as running again, after it
+ * was sent SIGCONT.
+ * @param job a job in the table
+ */
+void job_mark_running( JOB *job )
+{
+  int i;
+
+  for( i = 0; i < job->nprocs; i++ ) {
+    if( job->procs[i].state == PROCESS_STOPPED )
+      job->procs[i].state = PROCESS_RUNNING;
+  }
+}
+
+
+
+/**
+ * @param job a job that is done
+ * @return the wait status of the job's last process
+ */
+int job_status( JOB *job )
+{
+  assert( job->nprocs > 0 );
+  return job->procs[job->nprocs - 1].status;
+}
+
+
+
+/**
+ * Finds a job by number.
+ *
+ * @param id the job number
+ * @return the job, or NULL if there is none with that number
+ */
+JOB *job_find( int id )
+{
+  JOB *job;
+
+  for( job = jobs; job != NULL; job = job->next ) {
+    if( job->id == id )
+      return job;
+  }
+  return NULL;
+}
+
+
+
+/**
+ * @return the most recently started job, or NULL if the table is empty
+ */
+JOB *job_current( void )
+{
+  JOB *job = jobs;
+
+  while( job != NULL && job->next != NULL )
+    job = job->next;
+  return job;
+}
+
+
+
+/**
+ * @return the first job in the table, for walking the list with ->next
+ */
+JOB *job_first( void )
+{
+  return jobs;
+}
+
+
+
+/**
+ * Removes a job from the table and frees it.
+ * @param job a job in the table
+ */
+void job_remove( JOB *job )
+{
+  JOB **link;
+
+  for( link = &jobs; *link != NULL; link = &(*link)->next ) {
+    if( *link == job ) {
+      *link = job->next;
+      free( job->procs );
+      free( job->command );
+      free( job );
+      return;
+    }
+  }
+}
@@ -0,0 +1,174 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+
+
+/* states of a process in a job */
+#define PROCESS_RUNNING 0
+#define PROCESS_STOPPED 1
+#define PROCESS_DONE 2
+
+/* what the deadline of a job means */
+#define JOB_TIMEOUT_NONE 0	/* no deadline */
+#define JOB_TIMEOUT_ARMED 1	/* send SIGTERM at the deadline */
+#define JOB_TIMEOUT_TERMINATED 2	/* SIGTERM sent; send SIGKILL at the deadline */
+
+
+
+/**
+ * One process of a job, i.e. one stage of a pipeline.
+ */
+typedef struct job_process {
+  pid_t pid;
+  int state;			/* PROCESS_RUNNING, _STOPPED or _DONE */
+  int status;			/* wait status once the process is done */
+  struct timespec started;	/* CLOCK_MONOTONIC when it was added */
+  struct timespec finished;	/* CLOCK_MONOTONIC when it was reaped */
+  struct rusage usage;		/* from wait4(), valid once it is done */
+} JOB_PROCESS;
+
+
+
+/**
+ * A pipeline started by the shell.  All of its processes share one
+ * process group, so the job can be signalled and given the terminal
+ * as a whole.
+ */
+typedef struct job {
+  int id;			/* job number, shown as [id] */
+  pid_t pgid;			/* process group of the job, 0 until known */
+  int background;		/* started with a trailing & */
+  char *command;		/* command line, for the jobs listing */
+  int timeout;			/* JOB_TIMEOUT_NONE, _ARMED or _TERMINATED */
+  struct timespec deadline;	/* CLOCK_MONOTONIC, unless timeout is _NONE */
+  int nprocs;			/* processes added so far */
+  int maxprocs;			/* size of procs */
+  JOB_PROCESS *procs;
+  struct job *next;		/* next job, in order of id */
+} JOB;
+
+
+
+/*
+ * The job table is only touched from the main loop of the shell.  No
+ * signal handler reads or writes it: SIGCHLD is taken from a signalfd
+ * and the process states are updated through job_reap_children().
+ */
+
+
+
+/**
+ * Adds a new job to the table.
+ *
+ * @param command the command line, copied into the job
+ * @param maxprocs the number of processes the job will have
+ * @param background whether the job runs in the background
+ * @return the new job, or NULL if it could not be allocated
+ */
+JOB *job_create( const char *command, int maxprocs, int background );
+
+
+
+/**
+ * Records a started process of the job.  The first one becomes the
+ * process group leader.
+ *
+ * @param job a job from job_create()
+ * @param pid the process id
+ */
+void job_add_process( JOB *job, pid_t pid );
+
+
+
+/**
+ * Collects the status and resource usage of every child that exited,
+ * stopped or continued without blocking, and stores them in the job
+ * table.  The shell calls it when its signalfd reports SIGCHLD and
+ * before it looks at the states of a job.
+ */
+void job_reap_children( void );
+
+
+
+/**
+ * Stores one wait status in the table.  Statuses of processes that do
+ * not belong to a job are ignored.
+ *
+ * @param pid the process the status belongs to
+ * @param status the status from wait4()
+ * @param usage the resource usage from wait4(), kept once the process is done
+ */
+void job_record_status( pid_t pid, int status, const struct rusage *usage );
+
+
+
+/**
+ * @param job a job in the table
+ * @return 1 if every process of the job has terminated
+ */
+int job_is_done( JOB *job );
+
+
+
+/**
+ * @param job a job in the table
+ * @return 1 if the job is not done and none of its processes is running
+ */
+int job_is_stopped( JOB *job );
+
+
+
+/**
+ * Marks the stopped processes of the job as running again, after it
+ * was sent SIGCONT.
+ * @param job a job in the table
+ */
+void job_mark_running( JOB *job );
+
+
+
+/**
+ * @param job a job that is done
+ * @return the wait status of the job's last process
+ */
+int job_status( JOB *job );
+
+
+
+/**
+ * Finds a job by number.
+ *
+ * @param id the job number
+ * @return the job, or NULL if there is none with that number
+ */
+JOB *job_find( int id );
+
+
+
+/**
+ * @return the most recently started job, or NULL if the table is empty
+ */
+JOB *job_current( void );
+
+
+
+/**
+ * @return the first job in the table, for walking the list with ->next
+ */
+JOB *job_first( void );
+
+
+
+/**
+ * Removes a job from the table and frees it.
+ * @param job a job in the table
+ */
+void job_remove( JOB *job );
+
+
+#endif
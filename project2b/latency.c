@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "latency.h"
+
+
+/* width of a printed latency, e.g. "123.4us" */
+#define LATENCY_WIDTH 9
+
+
+
+
+/**
+ * Returns the bucket a value falls in: values below LATENCY_SUB_BUCKETS
+ * have a bucket each, larger ones share a bucket with the values that
+ * agree in their highest LATENCY_SUB_BITS + 1 bits.
+ */
+static int bucket_of( uint64_t ns )
+{
+  int msb;
+
+  if( ns < LATENCY_SUB_BUCKETS )
+    return (int)ns;
+  msb = 63 - __builtin_clzll( ns );
+  return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+    (int)((ns >> (msb - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS);
+}
+
+
+
+/**
+ * Returns the highest value that falls in a bucket.
+ */
+static uint64_t bucket_high( int index )
+{
+  int group = index >> LATENCY_SUB_BITS;
+  uint64_t sub = index & (LATENCY_SUB_BUCKETS - 1);
+
+  if( group == 0 )
+    return sub;
+  return ((LATENCY_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+
+
+/**
+ * Prints a latency in the largest unit it has a whole one of.
+ */
+static void print_ns( uint64_t ns, FILE *out )
+{
+  if( ns < 1000 )
+    fprintf( out, " %*lluns", LATENCY_WIDTH - 2, (unsigned long long)ns );
+  else if( ns < 1000000 )
+    fprintf( out, " %*.1fus", LATENCY_WIDTH - 2, ns / 1e3 );
+  else if( ns < 1000000000 )
+    fprintf( out, " %*.2fms", LATENCY_WIDTH - 2, ns / 1e6 );
+  else
+    fprintf( out, " %*.3fs", LATENCY_WIDTH - 1, ns / 1e9 );
+}
+
+
+
+/**
+ * Initializes an empty histogram
+ *
+ * @param histogram the histogram, e.g. a static one
+ * @param name what is measured, shown in the report; not copied
+ */
+void latency_init( LATENCY_HISTOGRAM *histogram, const char *name )
+{
+  assert( histogram != NULL );
+  memset( histogram, 0, sizeof(LATENCY_HISTOGRAM) );
+  histogram->name = name;
+  histogram->min = UINT64_MAX;
+}
+
+
+
+/**
+ * Adds one value to the histogram.
+ *
+ * @param histogram an initialized histogram
+ * @param ns the latency in nanoseconds
+ */
+void latency_record( LATENCY_HISTOGRAM *histogram, uint64_t ns )
+{
+  histogram->buckets[bucket_of( ns )]++;
+  histogram->count++;
+  histogram->total += ns;
+  if( ns < histogram->min )
+    histogram->min = ns;
+  if( ns > histogram->max )
+    histogram->max = ns;
+}
+
+
+
+/**
+ * Estimates a percentile from the histogram.
+ *
+ * @param histogram an initialized histogram
+ * @param percent the percentile wanted, from 0 to 100
+ * @return the highest value of the bucket the percentile falls in, never
+ *         above the largest value recorded; 0 if the histogram is empty
+ */
+uint64_t latency_percentile( const LATENCY_HISTOGRAM *histogram, double percent )
+{
+  unsigned long rank;
+  unsigned long seen = 0;
+  uint64_t high;
+  int i;
+
+  if( histogram->count == 0 )
+    return 0;
+  /* the rank of the value, counted from 1 */
+  rank = (unsigned long)(percent / 100 * histogram->count + 0.5);
+  if( rank < 1 )
+    rank = 1;
+  for( i = 0; i < LATENCY_BUCKETS; i++ ) {
+    seen += histogram->buckets[i];
+    if( seen >= rank )
+      break;
+  }
+  high = bucket_high( i );
+  return high < histogram->max ? high : histogram->max;
+}
+
+
+
+/**
+ * Prints the column headings for latency_print().
+ *
+ * @param out the stream to print to
+ * @param label the heading of the column of names
+ */
+void latency_print_header( FILE *out, const char *label )
+{
+  fprintf( out, "%-10s %10s %*s %*s %*s %*s %*s %*s\n", label, "count",
+	   LATENCY_WIDTH, "mean", LATENCY_WIDTH, "min", LATENCY_WIDTH, "p50",
+	   LATENCY_WIDTH, "p90", LATENCY_WIDTH, "p99", LATENCY_WIDTH, "max" );
+}
+
+
+
+/**
+ * Prints one line with the name, count, mean, minimum, median, 90th and
+ * 99th percentiles and maximum of the histogram, each scaled to ns, us,
+ * ms or s.
+ *
+ * @param histogram an initialized histogram
+ * @param out the stream to print to
+ */
+void latency_print( const LATENCY_HISTOGRAM *histogram, FILE *out )
+{
+  fprintf( out, "%-10s %10lu", histogram->name, histogram->count );
+  if( histogram->count == 0 ) {
+    fprintf( out, "\n" );
+    return;
+  }
+  print_ns( histogram->total / histogram->count, out );
+  print_ns( histogram->min, out );
+  print_ns( latency_percentile( histogram, 50 ), out );
+  print_ns( latency_percentile( histogram, 90 ), out );
+  print_ns( latency_percentile( histogram, 99 ), out );
+  print_ns( histogram->max, out );
+  fprintf( out, "\n" );
+}
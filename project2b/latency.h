@@ -0,0 +1,88 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+
+/* every power of two is split into this many linear buckets, so a value
+ * is known to within 1/16 of itself */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+
+
+/**
+ * A log-linear histogram of latencies in nanoseconds.  Recording a
+ * value is a few arithmetic instructions and one increment, and the
+ * histogram covers the whole range of a uint64_t with a fixed relative
+ * error, from nanoseconds to hours.
+ */
+typedef struct latency_histogram {
+  const char *name;		/* what is measured, for the report */
+  unsigned long count;		/* values recorded */
+  uint64_t total;		/* sum of the values, for the mean */
+  uint64_t min;
+  uint64_t max;
+  unsigned long buckets[LATENCY_BUCKETS];
+} LATENCY_HISTOGRAM;
+
+
+
+/**
+ * Initializes an empty histogram
+ *
+ * @param histogram the histogram, e.g. a static one
+ * @param name what is measured, shown in the report; not copied
+ */
+void latency_init( LATENCY_HISTOGRAM *histogram, const char *name );
+
+
+
+/**
+ * Adds one value to the histogram.
+ *
+ * @param histogram an initialized histogram
+ * @param ns the latency in nanoseconds
+ */
+void latency_record( LATENCY_HISTOGRAM *histogram, uint64_t ns );
+
+
+
+/**
+ * Estimates a percentile from the histogram.
+ *
+ * @param histogram an initialized histogram
+ * @param percent the percentile wanted, from 0 to 100
+ * @return the highest value of the bucket the percentile falls in, never
+ *         above the largest value recorded; 0 if the histogram is empty
+ */
+uint64_t latency_percentile( const LATENCY_HISTOGRAM *histogram, double percent );
+
+
+
+/**
+ * Prints the column headings for latency_print().
+ *
+ * @param out the stream to print to
+ * @param label the heading of the column of names
+ */
+void latency_print_header( FILE *out, const char *label );
+
+
+
+/**
+ * Prints one line with the name, count, mean, minimum, median, 90th and
+ * 99th percentiles and maximum of the histogram, each scaled to ns, us,
+ * ms or s.
+ *
+ * @param histogram an initialized histogram
+ * @param out the stream to print to
+ */
+void latency_print( const LATENCY_HISTOGRAM *histogram, FILE *out );
+
+
+#endif
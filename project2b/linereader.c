@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include "linereader.h"
+
+
+
+
+/**
+ * Initializes the line reader
+ *
+ * @param fd the file descriptor to read lines from
+ * @param size the initial size of the chunk buffer
+ * @param max the size the buffer may grow to for long lines; a line
+ *        longer than max - 1 is discarded
+ * @return an initialized line reader on success, NULL on error.
+ */
+LINE_READER *init_line_reader( int fd, size_t size, size_t max )
+{
+  LINE_READER *reader;
+  assert( size > 1 && max >= size );
+
+  reader = (LINE_READER *)malloc(sizeof(LINE_READER));
+  if( reader == NULL )
+    return NULL;
+  reader->buf = (char *)malloc(size);
+  if( reader->buf == NULL ) {
+    free( reader );
+    return NULL;
+  }
+  reader->fd = fd;
+  reader->cap = size;
+  reader->max = max;
+  reader->start = 0;
+  reader->scan = 0;
+  reader->end = 0;
+  reader->error = 0;
+  reader->discarding = 0;
+  reader->keep_partial = 0;
+  reader->exact = 0;
+  reader->rewound = -1;
+  reader->wait = NULL;
+  reader->wait_arg = NULL;
+  return reader;
+}
+
+
+
+/**
+ * Deallocates space used by the line reader.
+ * @param reader a non-NULL, initialized line reader
+ */
+void free_line_reader( LINE_READER *reader )
+{
+  assert( reader != NULL );
+  free( reader->buf );
+  free( reader );
+}
+
+
+
+/**
+ * Installs a function that read_line() calls before each read(), to wait
+ * for input while it handles other events, e.g. in an event loop.  It
+ * should return once fd is readable (or at end of file), and return -1
+ * with errno set to fail the read; EINTR makes read_line() call it again.
+ *
+ * @param reader an initialized line reader
+ * @param wait the function, or NULL to block in read() directly
+ * @param arg passed to wait as its second argument
+ */
+void line_reader_set_wait( LINE_READER *reader, int (*wait)( int fd, void *arg ), void *arg )
+{
+  assert( reader != NULL );
+  reader->wait = wait;
+  reader->wait_arg = arg;
+}
+
+
+
+/**
+ * Chooses what read_line() does with a last line that is not terminated
+ * by '\n': a script should still run it, while text left at the prompt
+ * when the user types Ctrl-D is thrown away.
+ *
+ * @param reader an initialized line reader
+ * @param keep 1 to return the partial line, 0 to discard it (the default)
+ */
+void line_reader_keep_partial( LINE_READER *reader, int keep )
+{
+  assert( reader != NULL );
+  reader->keep_partial = keep;
+}
+
+
+
+/**
+ * Gives the bytes read past the last returned line back to the file, so
+ * that a child process sharing the descriptor reads them next, as sh
+ * does before it starts a command.  Only a seekable file can take them
+ * back.  The next read_line() keeps using the buffer if the offset was
+ * not moved in the meantime, and drops it otherwise.
+ *
+ * @param reader an initialized line reader
+ * @return 0 on success or if nothing was buffered, -1 with errno set
+ *         (ESPIPE for a pipe or a terminal) if the bytes stay buffered
+ */
+int line_reader_unread( LINE_READER *reader )
+{
+  off_t offset;
+  assert( reader != NULL );
+
+  if( reader->end == reader->start || reader->rewound != -1 )
+    return 0;
+  offset = lseek( reader->fd, -(off_t)(reader->end - reader->start), SEEK_CUR );
+  if( offset == -1 )
+    return -1;
+  reader->rewound = offset;
+  return 0;
+}
+
+
+
+/**
+ * Makes read_line() read one byte at a time, so that it never takes
+ * input past the '\n' of the line it returns.  For a descriptor that is
+ * shared with child processes but cannot seek, where
+ * line_reader_unread() cannot give read-ahead input back.
+ *
+ * @param reader an initialized line reader
+ * @param exact 1 to stop at each '\n', 0 to read whole chunks (the default)
+ */
+void line_reader_set_exact( LINE_READER *reader, int exact )
+{
+  assert( reader != NULL );
+  reader->exact = exact;
+}
+
+
+
+/**
+ * Retrieves the next line.  The trailing '\n' is replaced by '\0'.  The
+ * buffer doubles as needed to hold the whole line.  A line that does
+ * not fit in reader->max bytes is thrown away up to its '\n' and
+ * reported as an E2BIG error; reading can go on with the next line.
+ * The returned string lives inside the reader and is only valid until
+ * the next call, so copy it if it has to outlive that.
+ *
+ * @param reader an initialized line reader
+ * @return the next line, or NULL on end of file (a partial line that
+ *         is not terminated by '\n' is discarded unless
+ *         line_reader_keep_partial() said otherwise) or on an error, in
+ *         which case reader->error is set: E2BIG for an over-long line,
+ *         ENOMEM if the buffer could not grow, or the errno of a
+ *         failed read().
+ */
+char *read_line( LINE_READER *reader )
+{
+  assert( reader != NULL );
+  char *line;
+  char *nl;
+  char *grown;
+  size_t size;
+  ssize_t n;
+
+  reader->error = 0;
+  if( reader->rewound != -1 ) {
+    /* skip the given back bytes again, unless someone read them */
+    if( lseek( reader->fd, 0, SEEK_CUR ) != reader->rewound
+	|| lseek( reader->fd, reader->end - reader->start, SEEK_CUR ) == -1 )
+      reader->scan = reader->end = reader->start;
+    reader->rewound = -1;
+  }
+  for( ;; ) {
+    nl = memchr( reader->buf + reader->scan, '\n', reader->end - reader->scan );
+    if( nl != NULL && reader->discarding ) {
+      /* the end of an over-long line: drop it and report it once */
+      reader->start = reader->scan = (nl - reader->buf) + 1;
+      reader->discarding = 0;
+      reader->error = E2BIG;
+      return NULL;
+    }
+    if( nl != NULL ) {
+      *nl = '\0';
+      line = reader->buf + reader->start;
+      reader->start = reader->scan = (nl - reader->buf) + 1;
+      return line;
+    }
+    reader->scan = reader->end;
+
+    /* slide the partial line to the front to make room */
+    if( reader->start > 0 ) {
+      memmove( reader->buf, reader->buf + reader->start,
+	       reader->end - reader->start );
+      reader->end -= reader->start;
+      reader->scan = reader->end;
+      reader->start = 0;
+    }
+
+    /* no newline in a full buffer: grow it, or skip to the next one */
+    if( reader->end == reader->cap - 1 && reader->cap == reader->max ) {
+      reader->discarding = 1;
+      reader->start = reader->scan = reader->end = 0;
+    }
+    else if( reader->end == reader->cap - 1 ) {
+      size = reader->cap * 2;
+      if( size > reader->max )
+	size = reader->max;
+      grown = (char *)realloc( reader->buf, size );
+      if( grown == NULL ) {
+	reader->error = ENOMEM;
+	return NULL;
+      }
+      reader->buf = grown;
+      reader->cap = size;
+    }
+
+    if( reader->wait != NULL && reader->wait( reader->fd, reader->wait_arg ) == -1 ) {
+      if( errno == EINTR )
+	continue;
+      reader->error = errno;
+      return NULL;
+    }
+    n = read( reader->fd, reader->buf + reader->end,
+	      reader->exact ? 1 : reader->cap - 1 - reader->end );
+    if( n == -1 ) {
+      if( errno == EINTR )
+	continue;
+      reader->error = errno;
+      return NULL;
+    }
+    if( n == 0 ) {		/* EOF */
+      if( reader->discarding ) {
+	reader->discarding = 0;
+	reader->error = E2BIG;
+      }
+      else if( reader->keep_partial && reader->end > reader->start ) {
+	reader->buf[reader->end] = '\0';
+	line = reader->buf + reader->start;
+	reader->start = reader->scan = reader->end;
+	return line;
+      }
+      return NULL;
+    }
+    reader->end += n;
+  }
+}
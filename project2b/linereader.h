@@ -0,0 +1,128 @@
+#ifndef __LINEREADER_H__
+#define __LINEREADER_H__
+
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+
+
+/**
+ * Control structure for a buffered line reader.  Input is pulled from
+ * the file descriptor in large chunks; bytes past the end of the line
+ * that was handed back stay in the buffer for the next call.
+ */
+typedef struct line_reader {
+  int fd;			/* descriptor to read from */
+  char *buf;			/* chunk buffer */
+  size_t cap;			/* size of buf */
+  size_t max;			/* buf never grows past this size */
+  size_t start;			/* first byte not yet handed out */
+  size_t scan;			/* bytes before this were searched for '\n' */
+  size_t end;			/* one past the last valid byte */
+  int error;			/* errno of a failed read(), 0 otherwise */
+  int discarding;		/* skipping the rest of an over-long line */
+  int keep_partial;		/* hand back an unterminated last line */
+  int exact;			/* read() one byte at a time */
+  off_t rewound;		/* offset buffered bytes were given back at, or -1 */
+  int (*wait)( int fd, void *arg );	/* called before every read(), or NULL */
+  void *wait_arg;		/* passed to wait */
+} LINE_READER;
+
+
+
+/**
+ * Initializes the line reader
+ *
+ * @param fd the file descriptor to read lines from
+ * @param size the initial size of the chunk buffer
+ * @param max the size the buffer may grow to for long lines; a line
+ *        longer than max - 1 is discarded
+ * @return an initialized line reader on success, NULL on error.
+ */
+LINE_READER *init_line_reader( int fd, size_t size, size_t max );
+
+
+
+/**
+ * Deallocates space used by the line reader.
+ * @param reader a non-NULL, initialized line reader
+ */
+void free_line_reader( LINE_READER *reader );
+
+
+
+/**
+ * Installs a function that read_line() calls before each read(), to wait
+ * for input while it handles other events, e.g. in an event loop.  It
+ * should return once fd is readable (or at end of file), and return -1
+ * with errno set to fail the read; EINTR makes read_line() call it again.
+ *
+ * @param reader an initialized line reader
+ * @param wait the function, or NULL to block in read() directly
+ * @param arg passed to wait as its second argument
+ */
+void line_reader_set_wait( LINE_READER *reader, int (*wait)( int fd, void *arg ), void *arg );
+
+
+
+/**
+ * Chooses what read_line() does with a last line that is not terminated
+ * by '\n': a script should still run it, while text left at the prompt
+ * when the user types Ctrl-D is thrown away.
+ *
+ * @param reader an initialized line reader
+ * @param keep 1 to return the partial line, 0 to discard it (the default)
+ */
+void line_reader_keep_partial( LINE_READER *reader, int keep );
+
+
+
+/**
+ * Gives the bytes read past the last returned line back to the file, so
+ * that a child process sharing the descriptor reads them next, as sh
+ * does before it starts a command.  Only a seekable file can take them
+ * back.  The next read_line() keeps using the buffer if the offset was
+ * not moved in the meantime, and drops it otherwise.
+ *
+ * @param reader an initialized line reader
+ * @return 0 on success or if nothing was buffered, -1 with errno set
+ *         (ESPIPE for a pipe or a terminal) if the bytes stay buffered
+ */
+int line_reader_unread( LINE_READER *reader );
+
+
+
+/**
+ * Makes read_line() read one byte at a time, so that it never takes
+ * input past the '\n' of the line it returns.  For a descriptor that is
+ * shared with child processes but cannot seek, where
+ * line_reader_unread() cannot give read-ahead input back.
+ *
+ * @param reader an initialized line reader
+ * @param exact 1 to stop at each '\n', 0 to read whole chunks (the default)
+ */
+void line_reader_set_exact( LINE_READER *reader, int exact );
+
+
+
+/**
+ * Retrieves the next line.  The trailing '\n' is replaced by '\0'.  The
+ * buffer doubles as needed to hold the whole line.  A line that does
+ * not fit in reader->max bytes is thrown away up to its '\n' and
+ * reported as an E2BIG error; reading can go on with the next line.
+ * The returned string lives inside the reader and is only valid until
+ * the next call, so copy it if it has to outlive that.
+ *
+ * @param reader an initialized line reader
+ * @return the next line, or NULL on end of file (a partial line that
+ *         is not terminated by '\n' is discarded unless
+ *         line_reader_keep_partial() said otherwise) or on an error, in
+ *         which case reader->error is set: E2BIG for an over-long line,
+ *         ENOMEM if the buffer could not grow, or the errno of a
+ *         failed read().
+ */
+char *read_line( LINE_READER *reader );
+
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "parser.h"
+#include "tokenizer.h"
+
+
+/* argument and stage arrays start this small and double when full */
+#define PARSER_INITIAL_ARGS 8
+#define PARSER_INITIAL_STAGES 4
+#define PARSER_INITIAL_TOKENS 16
+
+/* the tokens with a meaning of their own */
+#define OP_NONE 0		/* a word */
+#define OP_PIPE 1		/* | */
+#define OP_BACKGROUND 2		/* & */
+#define OP_INPUT 3		/* < */
+#define OP_OUTPUT 4		/* > */
+#define OP_APPEND 5		/* >> */
+#define OP_ERROR 6		/* 2> */
+#define OP_ERROR_APPEND 7	/* 2>> */
+#define OP_ERROR_TO_OUTPUT 8	/* 2>&1 */
+
+
+
+
+/**
+ * Makes room for one more pointer in an arena array of *size entries
+ * holding used of them, doubling it if it is full.  The old array stays
+ * in the arena until it is reset.
+ *
+ * @return the array, or NULL if the arena could not grow
+ */
+static char **grow_array( ARENA *arena, char **array, int used, int *size )
+{
+  char **grown;
+
+  if( used < *size )
+    return array;
+  grown = (char **)arena_alloc( arena, sizeof(char *) * *size * 2 );
+  if( grown == NULL )
+    return NULL;
+  memcpy( grown, array, sizeof(char *) * used );
+  *size *= 2;
+  return grown;
+}
+
+
+
+/**
+ * Tells which operator a token is.  The tokenizer returns the operators
+ * as tokens of their own, and no word can be spelled like one.
+ */
+static int operator_of( const char *tok )
+{
+  static const char *operators[] = { "|", "&", "<", ">", ">>", "2>", "2>>", "2>&1" };
+  size_t i;
+
+  if( strchr("|&<>2", tok[0]) == NULL )
+    return OP_NONE;
+  for( i = 0; i < sizeof(operators) / sizeof(operators[0]); i++ ) {
+    if( strcmp(tok, operators[i]) == 0 )
+      return OP_PIPE + i;
+  }
+  return OP_NONE;
+}
+
+
+
+/**
+ * Adds an empty stage to the pipeline, doubling the stage array if it is
+ * full.
+ *
+ * @return the new stage, or NULL if the arena could not grow
+ */
+static STAGE *begin_stage( ARENA *arena, PIPELINE *pipeline, int *stages_size,
+			   int *args_size )
+{
+  STAGE *grown;
+  STAGE *stage;
+
+  if( pipeline->nstages == *stages_size ) {
+    grown = (STAGE *)arena_alloc( arena, sizeof(STAGE) * *stages_size * 2 );
+    if( grown == NULL )
+      return NULL;
+    memcpy( grown, pipeline->stages, sizeof(STAGE) * pipeline->nstages );
+    pipeline->stages = grown;
+    *stages_size *= 2;
+  }
+  stage = &pipeline->stages[pipeline->nstages];
+  *args_size = PARSER_INITIAL_ARGS;
+  stage->argv = (char **)arena_alloc( arena, sizeof(char *) * *args_size );
+  if( stage->argv == NULL )
+    return NULL;
+  stage->argc = 0;
+  stage->input = NULL;
+  stage->output = NULL;
+  stage->append = 0;
+  stage->error_output = NULL;
+  stage->error_append = 0;
+  stage->error_dup = STAGE_ERROR_SEPARATE;
+  pipeline->nstages++;
+  return stage;
+}
+
+
+
+/**
+ * @return the error message for a redirection operator that is not
+ *         followed by a file name
+ */
+static const char *missing_file( int op )
+{
+  if( op == OP_INPUT )
+    return "Invalid standard input redirect: Empty file name";
+  if( op == OP_ERROR || op == OP_ERROR_APPEND )
+    return "Invalid standard error redirect: Empty file name";
+  return "Invalid standard output redirect: Empty file name";
+}
+
+
+
+/**
+ * Closes the stage being built: terminates its argument vector and
+ * checks that it has a command.
+ *
+ * @return the error message, or NULL if the stage is valid
+ */
+static const char *end_stage( STAGE *stage, int piped )
+{
+  stage->argv[stage->argc] = NULL;
+  if( stage->argc > 0 )
+    return NULL;
+  if( stage->input == NULL && stage->output == NULL && piped )
+    return "Invalid: Empty command in pipe";
+  return "Invalid: Missing command";
+}
+
+
+
+/**
+ * Joins the tokens with single spaces, for the job listing.
+ *
+ * @return the joined string, or NULL if the arena could not grow
+ */
+static char *join_tokens( ARENA *arena, char **tokens, int count )
+{
+  size_t length = 1;
+  size_t token_length;
+  char *text;
+  char *end;
+  int i;
+
+  for( i = 0; i < count; i++ )
+    length += strlen( tokens[i] ) + 1;
+  text = (char *)arena_alloc( arena, length );
+  if( text == NULL )
+    return NULL;
+  end = text;
+  for( i = 0; i < count; i++ ) {
+    if( i > 0 )
+      *end++ = ' ';
+    token_length = strlen( tokens[i] );
+    memcpy( end, tokens[i], token_length );
+    end += token_length;
+  }
+  *end = '\0';
+  return text;
+}
+
+
+
+/**
+ * FNV-1a hash of a command line.
+ */
+static unsigned int hash_line( const char *line )
+{
+  unsigned int hash = 2166136261u;
+
+  for( ; *line != '\0'; line++ ) {
+    hash ^= (unsigned char)*line;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+
+/**
+ * Parses a command line in one pass over its tokens: stages are split
+ * at |, the files after <, >, >>, 2> and 2>> and the 2>&1 operators are
+ * taken out of the argument vectors and a trailing & marks a background
+ * job.  The tokens are copied, so the line may be reused once this
+ * returns.
+ *
+ * A line that is not a valid command still yields a pipeline, with
+ * error set to the reason: a missing or doubled redirection, an empty
+ * stage, < after the first stage, > or >> before the last one, or & that
+ * is not at the end.
+ *
+ * @param arena where the pipeline and its strings are allocated
+ * @param line the NUL-terminated command line
+ * @return the pipeline, or NULL if the arena could not grow
+ */
+PIPELINE *parse_command( ARENA *arena, char *line )
+{
+  PIPELINE *pipeline;
+  STAGE *stage = NULL;
+  TOKENIZER tokenizer;
+  TOKEN_VIEW view;
+  char **tokens;
+  char *tok;
+  int ntokens = 0;
+  int tokens_size = PARSER_INITIAL_TOKENS;
+  int stages_size = PARSER_INITIAL_STAGES;
+  int args_size = PARSER_INITIAL_ARGS;
+  int expect = OP_NONE;		/* the operator whose file comes next */
+  int op;
+
+  pipeline = (PIPELINE *)arena_alloc( arena, sizeof(PIPELINE) );
+  tokens = (char **)arena_alloc( arena, sizeof(char *) * tokens_size );
+  if( pipeline == NULL || tokens == NULL )
+    return NULL;
+  pipeline->stages = NULL;
+  pipeline->nstages = 0;
+  pipeline->background = 0;
+  pipeline->text = "";
+  pipeline->error = NULL;
+
+  init_tokenizer_view( &tokenizer, line );
+  while( get_next_token_view(&tokenizer, &view) ) {
+    tok = arena_strndup( arena, view.start, view.len );
+    tokens = grow_array( arena, tokens, ntokens, &tokens_size );
+    if( tok == NULL || tokens == NULL )
+      return NULL;
+    tokens[ntokens++] = tok;
+    if( pipeline->error != NULL )
+      continue;			/* the rest of the line is not looked at */
+    if( pipeline->background ) {
+      pipeline->error = "Invalid: Background mark only allowed at the end of a command";
+      continue;
+    }
+
+    if( stage == NULL ) {
+      pipeline->stages = (STAGE *)arena_alloc( arena, sizeof(STAGE) * stages_size );
+      if( pipeline->stages == NULL ||
+	  (stage = begin_stage( arena, pipeline, &stages_size, &args_size )) == NULL )
+	return NULL;
+    }
+    op = operator_of( tok );
+
+    if( expect != OP_NONE ) {
+      if( op != OP_NONE )
+	pipeline->error = missing_file( expect );
+      else if( expect == OP_INPUT )
+	stage->input = tok;
+      else if( expect == OP_ERROR || expect == OP_ERROR_APPEND ) {
+	stage->error_output = tok;
+	stage->error_append = expect == OP_ERROR_APPEND;
+      }
+      else {
+	stage->output = tok;
+	stage->append = expect == OP_APPEND;
+      }
+      expect = OP_NONE;
+    }
+    else if( op == OP_NONE ) {
+      stage->argv = grow_array( arena, stage->argv, stage->argc + 1, &args_size );
+      if( stage->argv == NULL )
+	return NULL;
+      stage->argv[stage->argc++] = tok;
+    }
+    else if( op == OP_PIPE ) {
+      if( stage->output != NULL )
+	pipeline->error = "Invalid: Standard output redirect only allowed in last pipe process";
+      else if( (pipeline->error = end_stage( stage, 1 )) == NULL &&
+	       (stage = begin_stage( arena, pipeline, &stages_size, &args_size )) == NULL )
+	return NULL;
+    }
+    else if( op == OP_BACKGROUND )
+      pipeline->background = 1;
+    else if( op == OP_INPUT ) {
+      if( pipeline->nstages > 1 )
+	pipeline->error = "Invalid: Standard input redirect only allowed in first pipe process";
+      else if( stage->input != NULL )
+	pipeline->error = "Invalid: Multiple standard input redirects";
+      else
+	expect = op;
+    }
+    else if( op == OP_OUTPUT || op == OP_APPEND ) {
+      if( stage->output != NULL )
+	pipeline->error = "Invalid: Multiple standard output redirects";
+      else
+	expect = op;
+    }
+    else if( stage->error_output != NULL || stage->error_dup != STAGE_ERROR_SEPARATE )
+      pipeline->error = "Invalid: Multiple standard error redirects";
+    else if( op == OP_ERROR_TO_OUTPUT )
+      stage->error_dup = stage->output != NULL ? STAGE_ERROR_TO_OUTPUT : STAGE_ERROR_TO_INHERITED;
+    else
+      expect = op;
+  }
+
+  if( stage != NULL && pipeline->error == NULL ) {
+    if( expect != OP_NONE )
+      pipeline->error = missing_file( expect );
+    else
+      pipeline->error = end_stage( stage, pipeline->nstages > 1 );
+  }
+  if( pipeline->error == NULL && pipeline->nstages > 0 ) {
+    pipeline->text = join_tokens( arena, tokens, ntokens - pipeline->background );
+    if( pipeline->text == NULL )
+      return NULL;
+  }
+  return pipeline;
+}
+
+
+
+/**
+ * Initializes an empty parse cache
+ *
+ * @param max_entries the number of lines kept before the cache is dropped
+ * @param block_size the block size of the cache's arena
+ * @return an initialized parse cache on success, NULL on error.
+ */
+PARSE_CACHE *init_parse_cache( size_t max_entries, size_t block_size )
+{
+  PARSE_CACHE *cache;
+
+  assert( max_entries > 0 );
+  cache = (PARSE_CACHE *)malloc(sizeof(PARSE_CACHE));
+  if( cache == NULL )
+    return NULL;
+  /* a load factor of at most one */
+  for( cache->nbuckets = 1; cache->nbuckets < max_entries; cache->nbuckets *= 2 )
+    ;
+  cache->buckets = (PARSE_CACHE_ENTRY **)calloc( cache->nbuckets, sizeof(PARSE_CACHE_ENTRY *) );
+  cache->arena = init_arena( block_size );
+  if( cache->buckets == NULL || cache->arena == NULL ) {
+    free( cache->buckets );
+    if( cache->arena != NULL )
+      free_arena( cache->arena );
+    free( cache );
+    return NULL;
+  }
+  cache->count = 0;
+  cache->max_entries = max_entries;
+  cache->hits = 0;
+  cache->misses = 0;
+  return cache;
+}
+
+
+
+/**
+ * Deallocates the parse cache and everything it holds.
+ * @param cache a non-NULL, initialized parse cache
+ */
+void free_parse_cache( PARSE_CACHE *cache )
+{
+  assert( cache != NULL );
+  free_arena( cache->arena );
+  free( cache->buckets );
+  free( cache );
+}
+
+
+
+/**
+ * Returns the pipeline a line parses to, from the cache if the same line
+ * was parsed before and parsed (and remembered) otherwise.  The pipeline
+ * must not be modified; it stays valid until the next lookup.
+ *
+ * @param cache an initialized parse cache
+ * @param line the NUL-terminated command line
+ * @return the pipeline, or NULL if memory ran out
+ */
+PIPELINE *parse_cache_lookup( PARSE_CACHE *cache, char *line )
+{
+  assert( cache != NULL );
+  unsigned int hash = hash_line( line );
+  PARSE_CACHE_ENTRY *entry;
+
+  for( entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry != NULL;
+       entry = entry->next ) {
+    if( entry->hash == hash && strcmp(entry->line, line) == 0 ) {
+      cache->hits++;
+      return entry->pipeline;
+    }
+  }
+  cache->misses++;
+
+  /* full: start over rather than track which lines are still in use */
+  if( cache->count == cache->max_entries ) {
+    arena_reset( cache->arena );
+    memset( cache->buckets, 0, sizeof(PARSE_CACHE_ENTRY *) * cache->nbuckets );
+    cache->count = 0;
+  }
+  entry = (PARSE_CACHE_ENTRY *)arena_alloc( cache->arena, sizeof(PARSE_CACHE_ENTRY) );
+  if( entry == NULL ||
+      (entry->line = arena_strndup( cache->arena, line, strlen(line) )) == NULL ||
+      (entry->pipeline = parse_command( cache->arena, line )) == NULL )
+    return NULL;
+  entry->hash = hash;
+  entry->next = cache->buckets[hash & (cache->nbuckets - 1)];
+  cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+  cache->count++;
+  return entry->pipeline;
+}
@@ -0,0 +1,128 @@
+#ifndef __PARSER_H__
+#define __PARSER_H__
+
+
+#include <stdlib.h>
+#include "arena.h"
+
+
+
+/* where 2>&1 sends the standard error of a stage */
+#define STAGE_ERROR_SEPARATE 0	/* no 2>&1 */
+#define STAGE_ERROR_TO_OUTPUT 1	/* where standard output finally goes */
+#define STAGE_ERROR_TO_INHERITED 2	/* 2>&1 came before >: the output it replaced */
+
+
+
+/**
+ * One command of a pipeline: its argument vector and the files its
+ * standard input, output and error are redirected to.
+ */
+typedef struct stage {
+  char **argv;			/* command and arguments, NULL-terminated */
+  int argc;			/* entries in argv before the NULL */
+  char *input;			/* file named after <, or NULL */
+  char *output;			/* file named after > or >>, or NULL */
+  int append;			/* output came after >> */
+  char *error_output;		/* file named after 2> or 2>>, or NULL */
+  int error_append;		/* error_output came after 2>> */
+  int error_dup;		/* STAGE_ERROR_SEPARATE, _TO_OUTPUT or _TO_INHERITED */
+} STAGE;
+
+
+
+/**
+ * A parsed command line: one or more stages connected by pipes.
+ */
+typedef struct pipeline {
+  STAGE *stages;
+  int nstages;			/* 0 for a blank line */
+  int background;		/* the line ended with & */
+  char *text;			/* the tokens joined by spaces, without the & */
+  const char *error;		/* why the line is invalid, or NULL */
+} PIPELINE;
+
+
+
+/**
+ * A parsed line remembered by the parse cache.
+ */
+typedef struct parse_cache_entry {
+  char *line;			/* the line as read */
+  unsigned int hash;		/* hash of line */
+  PIPELINE *pipeline;		/* what it parsed to */
+  struct parse_cache_entry *next;	/* next entry in the same bucket */
+} PARSE_CACHE_ENTRY;
+
+
+
+/**
+ * Control structure for a cache of parsed lines, for scripts that run
+ * the same lines over and over.  Everything it holds lives in its own
+ * arena; when max_entries lines are cached the whole cache is dropped
+ * and filled again.
+ */
+typedef struct parse_cache {
+  ARENA *arena;			/* entries, lines and pipelines */
+  PARSE_CACHE_ENTRY **buckets;	/* chained hash table */
+  size_t nbuckets;		/* always a power of two */
+  size_t count;			/* entries in the table */
+  size_t max_entries;		/* count is never larger */
+  unsigned long hits;		/* lookups answered from the cache */
+  unsigned long misses;		/* lookups that had to parse */
+} PARSE_CACHE;
+
+
+
+/**
+ * Parses a command line in one pass over its tokens: stages are split
+ * at |, the files after <, >, >>, 2> and 2>> and the 2>&1 operators are
+ * taken out of the argument vectors and a trailing & marks a background
+ * job.  The tokens are copied, so the line may be reused once this
+ * returns.
+ *
+ * A line that is not a valid command still yields a pipeline, with
+ * error set to the reason: a missing or doubled redirection, an empty
+ * stage, < after the first stage, > or >> before the last one, or & that
+ * is not at the end.
+ *
+ * @param arena where the pipeline and its strings are allocated
+ * @param line the NUL-terminated command line
+ * @return the pipeline, or NULL if the arena could not grow
+ */
+PIPELINE *parse_command( ARENA *arena, char *line );
+
+
+
+/**
+ * Initializes an empty parse cache
+ *
+ * @param max_entries the number of lines kept before the cache is dropped
+ * @param block_size the block size of the cache's arena
+ * @return an initialized parse cache on success, NULL on error.
+ */
+PARSE_CACHE *init_parse_cache( size_t max_entries, size_t block_size );
+
+
+
+/**
+ * Deallocates the parse cache and everything it holds.
+ * @param cache a non-NULL, initialized parse cache
+ */
+void free_parse_cache( PARSE_CACHE *cache );
+
+
+
+/**
+ * Returns the pipeline a line parses to, from the cache if the same line
+ * was parsed before and parsed (and remembered) otherwise.  The pipeline
+ * must not be modified; it stays valid until the next lookup.
+ *
+ * @param cache an initialized parse cache
+ * @param line the NUL-terminated command line
+ * @return the pipeline, or NULL if memory ran out
+ */
+PIPELINE *parse_cache_lookup( PARSE_CACHE *cache, char *line );
+
+
+#endif
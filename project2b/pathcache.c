@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pathcache.h"
+
+
+/* buckets in a new table; it doubles when it holds more entries */
+#define PATH_CACHE_INITIAL_BUCKETS 64
+
+/* what execvp() searches when PATH is not set */
+#define PATH_CACHE_DEFAULT_PATH "/bin:/usr/bin"
+
+
+
+
+/**
+ * FNV-1a hash of a command name.
+ */
+static unsigned int hash_name( const char *name )
+{
+  unsigned int hash = 2166136261u;
+
+  for( ; *name != '\0'; name++ ) {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+
+/**
+ * Tells whether the cache was filled against the current PATH.
+ */
+static int same_path_env( PATH_CACHE *cache, const char *path_env )
+{
+  if( cache->path_env == NULL || path_env == NULL )
+    return cache->path_env == path_env;
+  return strcmp( cache->path_env, path_env ) == 0;
+}
+
+
+
+/**
+ * Searches every PATH directory for an executable called name.
+ *
+ * @return the malloc'd path of the executable, or NULL with errno set
+ */
+static char *search_path( const char *path_env, const char *name )
+{
+  size_t name_len = strlen( name );
+  const char *dir = path_env;
+  const char *end;
+  size_t dir_len;
+  char *candidate;
+  struct stat st;
+  int denied = 0;
+
+  for( ;; ) {
+    end = strchr( dir, ':' );
+    dir_len = end != NULL ? (size_t)(end - dir) : strlen( dir );
+
+    /* an empty PATH element means the current directory */
+    candidate = (char *)malloc( dir_len + name_len + 3 );
+    if( candidate == NULL )
+      return NULL;
+    if( dir_len == 0 )
+      strcpy( candidate, "." );
+    else {
+      memcpy( candidate, dir, dir_len );
+      candidate[dir_len] = '\0';
+    }
+    strcat( candidate, "/" );
+    strcat( candidate, name );
+
+    if( stat(candidate, &st) == 0 && S_ISREG(st.st_mode) ) {
+      if( access(candidate, X_OK) == 0 )
+	return candidate;
+      denied = 1;
+    }
+    free( candidate );
+
+    if( end == NULL )
+      break;
+    dir = end + 1;
+  }
+  errno = denied ? EACCES : ENOENT;
+  return NULL;
+}
+
+
+
+/**
+ * Doubles the number of buckets and rehashes every entry.
+ */
+static void grow_table( PATH_CACHE *cache )
+{
+  size_t nbuckets = cache->nbuckets * 2;
+  PATH_ENTRY **buckets;
+  PATH_ENTRY *entry;
+  PATH_ENTRY *next;
+  size_t i;
+
+  buckets = (PATH_ENTRY **)calloc( nbuckets, sizeof(PATH_ENTRY *) );
+  if( buckets == NULL )
+    return;			/* keep the longer chains */
+  for( i = 0; i < cache->nbuckets; i++ ) {
+    for( entry = cache->buckets[i]; entry != NULL; entry = next ) {
+      next = entry->next;
+      entry->next = buckets[entry->hash & (nbuckets - 1)];
+      buckets[entry->hash & (nbuckets - 1)] = entry;
+    }
+  }
+  free( cache->buckets );
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+
+
+/**
+ * Initializes an empty path cache
+ *
+ * @return an initialized path cache on success, NULL on error.
+ */
+PATH_CACHE *init_path_cache( void )
+{
+  PATH_CACHE *cache;
+
+  cache = (PATH_CACHE *)malloc(sizeof(PATH_CACHE));
+  if( cache == NULL )
+    return NULL;
+  cache->nbuckets = PATH_CACHE_INITIAL_BUCKETS;
+  cache->buckets = (PATH_ENTRY **)calloc( cache->nbuckets, sizeof(PATH_ENTRY *) );
+  if( cache->buckets == NULL ) {
+    free( cache );
+    return NULL;
+  }
+  cache->count = 0;
+  cache->path_env = NULL;
+  return cache;
+}
+
+
+
+/**
+ * Deallocates the path cache and all of its entries.
+ * @param cache a non-NULL, initialized path cache
+ */
+void free_path_cache( PATH_CACHE *cache )
+{
+  assert( cache != NULL );
+  path_cache_clear( cache );
+  free( cache->buckets );
+  free( cache );
+}
+
+
+
+/**
+ * Resolves a command name to the executable execvp() would run.  Names
+ * containing a '/' are returned unchanged.  Other names are looked up
+ * in the table and, on a miss, searched for in every PATH directory
+ * and remembered.  The whole table is dropped first if PATH is no
+ * longer the value it was filled with.
+ *
+ * @param cache an initialized path cache
+ * @param name the command name
+ * @return the path to execute, owned by the cache and valid until the
+ *         entry is dropped; NULL if no executable was found, with errno
+ *         set to ENOENT or EACCES as execvp() would.
+ */
+const char *path_cache_lookup( PATH_CACHE *cache, const char *name )
+{
+  assert( cache != NULL );
+  const char *path_env = getenv( "PATH" );
+  unsigned int hash;
+  PATH_ENTRY *entry;
+  char *path;
+
+  if( name[0] == '\0' ) {
+    errno = ENOENT;
+    return NULL;
+  }
+  if( strchr(name, '/') != NULL )
+    return name;
+
+  if( !same_path_env(cache, path_env) ) {
+    path_cache_clear( cache );
+    if( path_env != NULL ) {
+      cache->path_env = strdup( path_env );
+      if( cache->path_env == NULL )
+	return NULL;
+    }
+  }
+
+  hash = hash_name( name );
+  for( entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry != NULL;
+       entry = entry->next ) {
+    if( entry->hash == hash && strcmp(entry->name, name) == 0 )
+      return entry->path;
+  }
+
+  path = search_path( path_env != NULL ? path_env : PATH_CACHE_DEFAULT_PATH, name );
+  if( path == NULL )
+    return NULL;			/* misses are not cached */
+
+  entry = (PATH_ENTRY *)malloc(sizeof(PATH_ENTRY));
+  if( entry == NULL || (entry->name = strdup(name)) == NULL ) {
+    free( entry );
+    free( path );
+    return NULL;
+  }
+  entry->path = path;
+  entry->hash = hash;
+  entry->next = cache->buckets[hash & (cache->nbuckets - 1)];
+  cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+  if( ++cache->count > cache->nbuckets )
+    grow_table( cache );
+  return path;
+}
+
+
+
+/**
+ * Drops the entry for one name, e.g. after its executable could not be
+ * run any more.
+ *
+ * @param cache an initialized path cache
+ * @param name the command name
+ */
+void path_cache_forget( PATH_CACHE *cache, const char *name )
+{
+  assert( cache != NULL );
+  unsigned int hash = hash_name( name );
+  PATH_ENTRY **link = &cache->buckets[hash & (cache->nbuckets - 1)];
+  PATH_ENTRY *entry;
+
+  for( ; (entry = *link) != NULL; link = &entry->next ) {
+    if( entry->hash == hash && strcmp(entry->name, name) == 0 ) {
+      *link = entry->next;
+      free( entry->name );
+      free( entry->path );
+      free( entry );
+      cache->count--;
+      return;
+    }
+  }
+}
+
+
+
+/**
+ * Drops the entries found through a relative PATH directory, such as an
+ * empty element or ".", which point elsewhere once the working directory
+ * changes.
+ *
+ * @param cache an initialized path cache
+ */
+void path_cache_forget_relative( PATH_CACHE *cache )
+{
+  assert( cache != NULL );
+  PATH_ENTRY **link;
+  PATH_ENTRY *entry;
+  size_t i;
+
+  for( i = 0; i < cache->nbuckets; i++ ) {
+    for( link = &cache->buckets[i]; (entry = *link) != NULL; ) {
+      if( entry->path[0] == '/' ) {
+	link = &entry->next;
+	continue;
+      }
+      *link = entry->next;
+      free( entry->name );
+      free( entry->path );
+      free( entry );
+      cache->count--;
+    }
+  }
+}
+
+
+
+/**
+ * Drops every entry.
+ * @param cache an initialized path cache
+ */
+void path_cache_clear( PATH_CACHE *cache )
+{
+  assert( cache != NULL );
+  PATH_ENTRY *entry;
+  PATH_ENTRY *next;
+  size_t i;
+
+  for( i = 0; i < cache->nbuckets; i++ ) {
+    for( entry = cache->buckets[i]; entry != NULL; entry = next ) {
+      next = entry->next;
+      free( entry->name );
+      free( entry->path );
+      free( entry );
+    }
+    cache->buckets[i] = NULL;
+  }
+  cache->count = 0;
+  free( cache->path_env );
+  cache->path_env = NULL;
+}
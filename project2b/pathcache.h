@@ -0,0 +1,98 @@
+#ifndef __PATHCACHE_H__
+#define __PATHCACHE_H__
+
+
+#include <stdlib.h>
+
+
+
+/**
+ * A command name and the executable it resolved to.
+ */
+typedef struct path_entry {
+  char *name;			/* command as typed, e.g. "ls" */
+  char *path;			/* executable found in PATH, e.g. "/bin/ls" */
+  unsigned int hash;		/* hash of name */
+  struct path_entry *next;	/* next entry in the same bucket */
+} PATH_ENTRY;
+
+
+
+/**
+ * Control structure for a hashed command path cache, like the table
+ * behind the shell builtin "hash".  Entries are filled on the first
+ * lookup of a name and dropped when PATH changes.
+ */
+typedef struct path_cache {
+  PATH_ENTRY **buckets;		/* chained hash table */
+  size_t nbuckets;		/* always a power of two */
+  size_t count;			/* entries in the table */
+  char *path_env;		/* PATH the entries were resolved against */
+} PATH_CACHE;
+
+
+
+/**
+ * Initializes an empty path cache
+ *
+ * @return an initialized path cache on success, NULL on error.
+ */
+PATH_CACHE *init_path_cache( void );
+
+
+
+/**
+ * Deallocates the path cache and all of its entries.
+ * @param cache a non-NULL, initialized path cache
+ */
+void free_path_cache( PATH_CACHE *cache );
+
+
+
+/**
+ * Resolves a command name to the executable execvp() would run.  Names
+ * containing a '/' are returned unchanged.  Other names are looked up
+ * in the table and, on a miss, searched for in every PATH directory
+ * and remembered.  The whole table is dropped first if PATH is no
+ * longer the value it was filled with.
+ *
+ * @param cache an initialized path cache
+ * @param name the command name
+ * @return the path to execute, owned by the cache and valid until the
+ *         entry is dropped; NULL if no executable was found, with errno
+ *         set to ENOENT or EACCES as execvp() would.
+ */
+const char *path_cache_lookup( PATH_CACHE *cache, const char *name );
+
+
+
+/**
+ * Drops the entry for one name, e.g. after its executable could not be
+ * run any more.
+ *
+ * @param cache an initialized path cache
+ * @param name the command name
+ */
+void path_cache_forget( PATH_CACHE *cache, const char *name );
+
+
+
+/**
+ * Drops the entries found through a relative PATH directory, such as an
+ * empty element or ".", which point elsewhere once the working directory
+ * changes.
+ *
+ * @param cache an initialized path cache
+ */
+void path_cache_forget_relative( PATH_CACHE *cache );
+
+
+
+/**
+ * Drops every entry.
+ * @param cache an initialized path cache
+ */
+void path_cache_clear( PATH_CACHE *cache );
+
+
+#endif
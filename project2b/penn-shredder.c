@@ -1,558 +1,1815 @@
+// pipe2() and O_CLOEXEC
+#define _GNU_SOURCE
 #include <unistd.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
 #include "tokenizer.h"
+#include "linereader.h"
+#include "arena.h"
+#include "pathcache.h"
+#include "jobs.h"
+#include "pipecopy.h"
+#include "history.h"
+#include "parser.h"
+#include "latency.h"
 // could I use this?
 #include <fcntl.h>
 
-#define INPUT_SIZE 1024
-
-pid_t childPid = 0;
-pid_t childPid1 = 0;
-pid_t childPid2 = 0;
+// stdin is read in chunks of this size instead of one byte per read()
+#define READ_CHUNK_SIZE 65536
+// block size of the per-command arena; one block covers typical commands
+#define COMMAND_ARENA_BLOCK_SIZE 16384
+// scripts and seekable standard input are read in chunks of this size
+#define SCRIPT_CHUNK_SIZE (1024 * 1024)
+// script mode: distinct lines whose parse is kept, and the block size it is
+// kept in
+#define PARSE_CACHE_ENTRIES 4096
+#define PARSE_CACHE_BLOCK_SIZE (64 * 1024)
+// interactive history: lines kept, bytes for all of them, and the file under
+// $HOME
+#define HISTORY_ENTRIES 100000
+#define HISTORY_SIZE (8 * 1024 * 1024)
+#define HISTORY_FILE ".penn-shredder_history"
+// exit codes of commands that could not be run, as in sh
+#define EXIT_USAGE 2
+#define EXIT_NOT_STARTED 127
+// the order a stage's descriptors are moved into place: standard error first,
+// so that 2>&1 before > still copies the standard output the stage inherited
+static const int redirectionOrder[3] = {STDERR_FILENO, STDIN_FILENO, STDOUT_FILENO};
+// phases of executeShell timed by -P
+#define PHASE_READ 0            // reading a line (and expanding history)
+#define PHASE_PARSE 1           // tokenizing and parsing it, in one pass
+#define PHASE_LAUNCH 2          // starting one stage with posix_spawn or fork
+#define PHASE_WAIT 3            // from the last stage started until the job ends
+#define PHASE_BUILTIN 4         // running a builtin in the shell
+#define PHASE_CLEANUP 5         // releasing the command's arena
+#define PHASE_COUNT 6
+// size of the perfect hash table the builtins are looked up in
+#define BUILTIN_TABLE_SIZE 32
+
+// the job the shell is waiting for, NULL at the prompt
+JOB *foregroundJob = NULL;
+// job control: the terminal handed to foreground jobs, -1 without one
+int terminalFd = -1;
+pid_t shellPgid = 0;
 int test = 1;
-
-void executeShell();
+extern char **environ;
+LINE_READER *inputReader = NULL;
+// parse state of the current command, released in one reset per prompt
+ARENA *commandArena = NULL;
+// where each command name was found in PATH
+PATH_CACHE *commandPaths = NULL;
+// script mode: the parsed form of every line seen, so loops parse a line once
+PARSE_CACHE *parsedLines = NULL;
+// script mode: no prompt, and a summary of the run at the end
+int interactive = 1;
+long commandsRun = 0;
+long commandsFailed = 0;
+// set by the exit builtin
+int exitRequested = 0;
+int shellExitCode = 0;
+// per-job timeout in milliseconds (0: none) and the grace period between
+// SIGTERM and SIGKILL
+long commandTimeout = 0;
+long killGrace = 1000;
+// event loop: SIGCHLD arrives on childSignalFd, job deadlines on timerFd
+int childSignalFd = -1;
+int timerFd = -1;
+// capacity of the pipes between stages, set with F_SETPIPE_SZ (0: default)
+int pipeSize = 0;
+// previous command lines, in interactive mode only
+HISTORY *commandHistory = NULL;
+// resource accounting: -T prints each finished process, -S appends it to a file
+int timeCommands = 0;
+FILE *statsFile = NULL;
+// self-profiling: a latency histogram per phase, only filled with -P
+int profilePhases = 0;
+LATENCY_HISTOGRAM phaseLatency[PHASE_COUNT];
+
+int executeShell();
+void printScriptSummary(struct timespec *start);
 
 void writeToStdout(char *text);
 
-void alarmHandler(int sig);
-
 void sigintHandler(int sig);
 
-char **getCommandFromInput();
+PIPELINE *getCommandFromInput();
+void initHistory();
+char *expandHistory(char *line);
 
 void registerSignalHandlers();
 
-void killChildProcess();
+void initJobControl();
+
+void killForegroundJob();
 
 // helper function for trim the string
 
 char *trimSpaces(char *str);
+int countTokens(char **commandArray);
+void *allocateFromArena(size_t size);
 
-// redirections
-int redirectionToFile(const char *token, int fileDescriptor);
-int redirctionsSTDOUTtoFile(const char *token);
-int redirectionsSTDINtoFile(const char *token);
+// redirections: what a stage's standard input, output and error are dup2'd
+// from (-1: left as they are), and the files opened for them, which are
+// closed once the stage has started
+struct redirectionPlan
+{
+    int source[3];
+    int opened[3];
+};
+int planRedirections(STAGE *stage, int inputFd, int outputFd, struct redirectionPlan *plan);
+void applyRedirections(struct redirectionPlan *plan);
+void closeRedirections(struct redirectionPlan *plan);
+int openRedirectionFile(const char *token, int fileDescriptor, int append);
 
 // pipe
-char **createArrayOfTokensBeforePipe(char **commandArray);
-char **createArrayOfTokensAfterPipe(char **commandArray);
-
-char **redirectionsPipeWriterProcess(char **commandArrayBeforePipe, int *fd);
-char **redirectionsPipeReaderProcess(char **commandArrayAfterPipe, int *fd);
-
-int isPipe(char **commandArray);
-void processPipe(char **commandArray);
-void processRedirections(char **commandArray);
-void executeRedirections(char **commandArray);
+int processPipeline(PIPELINE *pipeline);
+int exitCodeOf(int status);
+void executeStage(STAGE *stage);
+pid_t launchCommand(STAGE *stage, int inputFd, int outputFd, pid_t pgid);
+pid_t forkCommand(STAGE *stage, int inputFd, int outputFd, pid_t pgid);
+int isCopyStage(STAGE *stage);
+pid_t launchCopy(STAGE *stage, int inputFd, int outputFd, pid_t pgid);
+void resetChildProcess(pid_t pgid);
+char *joinTokens(char **commandArray);
+
+// jobs
+int waitForForegroundJob(JOB *job);
+int waitForEvents(int fd);
+int waitForInput(int fd, void *arg);
+void armJobTimeout(JOB *job);
+void handleTimeouts();
+void armTimer();
+long parseMilliseconds(const char *text);
+void reportFinishedJobs();
+void printJob(JOB *job, const char *state);
+void finishJob(JOB *job);
+void reportJobUsage(JOB *job);
+double secondsBetween(struct timespec *start, struct timespec *end);
+JOB *findJobFromArgument(const char *name, char *argument);
+
+// builtins, run inside the shell process
+typedef int (*BuiltinFunction)(char **argv);
+struct builtin
+{
+    const char *name;
+    BuiltinFunction function;
+};
+void initBuiltins();
+unsigned int builtinHash(const char *name);
+struct builtin *findBuiltin(const char *name);
+int runBuiltin(PIPELINE *pipeline, int *exitCode);
+int swapStandardFds(struct redirectionPlan *plan, int saved[3]);
+void restoreStandardFds(int saved[3]);
+int builtinCd(char **argv);
+int builtinEcho(char **argv);
+int builtinPwd(char **argv);
+int builtinExit(char **argv);
+int builtinTrue(char **argv);
+int builtinFalse(char **argv);
+int builtinJobs(char **argv);
+int builtinFg(char **argv);
+int builtinBg(char **argv);
+int builtinWait(char **argv);
+int builtinParallel(char **argv);
+int builtinHistory(char **argv);
+int builtinStats(char **argv);
+double secondsSince(struct timespec *start);
+
+// self-profiling
+void initPhases();
+void phaseStart(struct timespec *start);
+void phaseEnd(int phase, struct timespec *start);
+void printPhases(FILE *out);
 
 int output(char *str);
 
+/* Usage: penn-shredder [-T] [-P] [-S statsfile] [-t ms] [-g ms] [-p bytes]
+ *                      [-f script]
+ * Commands are read from the script, or from standard input. The shell runs
+ * in script mode, without a prompt, when it reads a script or when standard
+ * input is not a terminal.
+ *
+ * -T reports the wall time, CPU time, maximum resident set size and page faults
+ * of every command (every stage of a pipeline) to standard error as it
+ * finishes; -S appends the same figures to statsfile, one tab separated line
+ * per process.
+ *
+ * -t gives every job a deadline of ms milliseconds from its start. A job that
+ * is still running then gets SIGTERM, and SIGKILL if it has not finished
+ * after the grace period set with -g (1000 ms by default).
+ *
+ * -p sets the capacity of the pipes between pipeline stages, which the
+ * kernel caps at /proc/sys/fs/pipe-max-size for unprivileged users.
+ *
+ * -P profiles the shell itself: the time spent reading, parsing, starting,
+ * waiting for and cleaning up after every command goes into a latency
+ * histogram per phase, printed to standard error at exit and by the stats
+ * builtin. It shows whether the shell or its commands take the time of a
+ * batch run */
 int main(int argc, char **argv)
 {
+    int inputFd = STDIN_FILENO;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:TPS:t:g:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            inputFd = open(optarg, O_RDONLY | O_CLOEXEC);
+            if (inputFd == -1)
+            {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            timeCommands = 1;
+            break;
+        case 'P':
+            profilePhases = 1;
+            break;
+        case 't':
+        case 'g':
+            if (parseMilliseconds(optarg) == -1)
+            {
+                fprintf(stderr, "%s: -%c needs a number of milliseconds\n", argv[0], opt);
+                exit(EXIT_USAGE);
+            }
+            *(opt == 't' ? &commandTimeout : &killGrace) = parseMilliseconds(optarg);
+            break;
+        case 'p':
+            pipeSize = atoi(optarg);
+            if (pipeSize <= 0)
+            {
+                fprintf(stderr, "%s: -p needs a pipe size in bytes\n", argv[0]);
+                exit(EXIT_USAGE);
+            }
+            break;
+        case 'S':
+            statsFile = fopen(optarg, "ae");
+            if (statsFile == NULL)
+            {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (ftell(statsFile) == 0)
+            {
+                fprintf(statsFile, "command\tstage\tpid\texit\treal\tuser\tsys\tmaxrss_kb\tminflt\tmajflt\n");
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-T] [-P] [-S statsfile] [-t ms] [-g ms] [-p bytes] [-f script]\n", argv[0]);
+            exit(EXIT_USAGE);
+        }
+    }
+    interactive = isatty(inputFd);
+    if (isatty(STDIN_FILENO))
+    {
+        terminalFd = STDIN_FILENO;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     registerSignalHandlers();
-    while (1)
+    initJobControl();
+    initBuiltins();
+    initPhases();
+    // a command line can be as long as the kernel would accept for execve()
+    long lineMax = sysconf(_SC_ARG_MAX);
+    size_t chunkSize = interactive ? READ_CHUNK_SIZE : SCRIPT_CHUNK_SIZE;
+    if (lineMax < (long)chunkSize)
     {
-        executeShell();
+        lineMax = chunkSize;
     }
-    return 0;
+    inputReader = init_line_reader(inputFd, chunkSize, lineMax);
+    commandArena = init_arena(COMMAND_ARENA_BLOCK_SIZE);
+    commandPaths = init_path_cache();
+    if (inputReader == NULL || commandArena == NULL || commandPaths == NULL)
+    {
+        perror("invalid: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    // background jobs are reaped and timed out while the shell waits for input
+    line_reader_set_wait(inputReader, waitForInput, NULL);
+    // a script's last line runs even without a new line; at the prompt,
+    // Ctrl + D drops whatever was typed
+    line_reader_keep_partial(inputReader, !interactive);
+    // commands share a piped standard input, which cannot take read-ahead
+    // input back, so it is read up to each new line only, as in sh. A
+    // terminal returns one line per read() anyway, and a -f script is
+    // close-on-exec
+    if (!interactive && inputFd == STDIN_FILENO && lseek(inputFd, 0, SEEK_CUR) == -1)
+    {
+        line_reader_set_exact(inputReader, 1);
+    }
+    if (interactive)
+    {
+        initHistory();
+    }
+    else
+    {
+        parsedLines = init_parse_cache(PARSE_CACHE_ENTRIES, PARSE_CACHE_BLOCK_SIZE);
+        if (parsedLines == NULL)
+        {
+            perror("invalid: malloc failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    while (executeShell())
+    {
+    }
+    if (!interactive)
+    {
+        printScriptSummary(&start);
+    }
+    if (profilePhases)
+    {
+        printPhases(stderr);
+    }
+    return shellExitCode;
+}
+
+/* Prints how many commands the script ran, how many of them failed and the
+ * wall and CPU time of the run (the shell and all of its children) to
+ * standard error, so that it does not mix with the commands' output */
+void printScriptSummary(struct timespec *start)
+{
+    struct timespec end;
+    struct rusage self;
+    struct rusage children;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    double wall = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    double user = self.ru_utime.tv_sec + children.ru_utime.tv_sec +
+                  (self.ru_utime.tv_usec + children.ru_utime.tv_usec) / 1e6;
+    double sys = self.ru_stime.tv_sec + children.ru_stime.tv_sec +
+                 (self.ru_stime.tv_usec + children.ru_stime.tv_usec) / 1e6;
+    fprintf(stderr, "penn-shredder: %ld commands, %ld failed, %.3fs wall, %.3fs user, %.3fs sys\n",
+            commandsRun, commandsFailed, wall, user, sys);
 }
 
-/* Sends SIGKILL signal to a child process.
+/* Sends SIGKILL signal to every process of the foreground job.
  * Error checks for kill system call failure and exits program if
  * there is an error */
-void killChildProcess()
+void killForegroundJob()
 {
-    if (kill(childPid, SIGKILL) == -1)
+    // the job's process group is gone once all of its processes were reaped;
+    // a job that has not started a process yet has none (and kill(0) would
+    // hit the shell's own group)
+    if (foregroundJob->pgid > 0 && kill(-foregroundJob->pgid, SIGKILL) == -1 && errno != ESRCH)
     {
         perror("Error in kill");
         exit(EXIT_FAILURE);
     }
 }
 
-/* Signal handler for SIGALRM. Catches SIGALRM signal and
- * kills the child process if it exists and is still executing.
- * It then prints out penn-shredder's catchphrase to standard output */
-void alarmHandler(int sig)
+/* Signal handler for SIGINT. Catches SIGINT signal (e.g. Ctrl + C) and
+ * kills the foreground job, every stage of it, if it exists and is
+ * executing. Does not do anything to the parent process and its execution,
+ * nor to background jobs */
+void sigintHandler(int sig)
+{
+    (void)sig;
+    if (foregroundJob != NULL)
+    {
+        killForegroundJob();
+    }
+}
+
+/* Registers the SIGINT handler, and sets up the descriptors of the event
+ * loop: SIGCHLD stays blocked for good and is read from a signalfd, and job
+ * deadlines fire on a timerfd. Error checks for signal system call failure
+ * and exits program if there is an error */
+void registerSignalHandlers()
 {
-    if (sig == SIGALRM)
+    if (signal(SIGINT, sigintHandler) == SIG_ERR)
+    {
+        perror("Error in signal");
+        exit(EXIT_FAILURE);
+    }
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, NULL) == -1)
+    {
+        perror("Error in child signal");
+        exit(EXIT_FAILURE);
+    }
+    childSignalFd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (childSignalFd == -1 || timerFd == -1)
+    {
+        perror("Error in event loop setup");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* With a terminal, puts the shell in its own process group in the terminal's
+ * foreground. Every job gets a process group of its own, which is handed the
+ * terminal while it runs in the foreground. The shell ignores the job control
+ * stop signals so that Ctrl + Z only stops the job */
+void initJobControl()
+{
+    if (terminalFd == -1)
+    {
+        return;
+    }
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    // fails harmlessly if the shell already leads its group or session
+    setpgid(0, 0);
+    shellPgid = getpgrp();
+    if (tcsetpgrp(terminalFd, shellPgid) == -1)
+    {
+        perror("Error in tcsetpgrp");
+        terminalFd = -1;
+    }
+}
+
+/* Prints the shell prompt (unless in script mode) and waits for input from
+ * user. It then runs the command as a job, with the deadline set by -t, and
+ * waits for it unless it was started in the background. Returns 0 once the
+ * input is exhausted, 1 otherwise */
+int executeShell()
+{
+    PIPELINE *pipeline;
+    char minishell[] = "penn-sh> ";
+    // background jobs that finished while the last command ran
+    reportFinishedJobs();
+    if (interactive)
+    {
+        writeToStdout(minishell);
+    }
+
+    pipeline = getCommandFromInput();
+    if (pipeline == NULL)
     {
-        if (childPid != 0)
+        return 0;
+    }
+    // check for empty command
+    if (pipeline->nstages > 0)
+    {
+        int exitCode;
+        if (inputReader->fd == STDIN_FILENO)
+        {
+            // commands read standard input from right after this line, as
+            // in sh; only a seekable file can take the read-ahead back
+            line_reader_unread(inputReader);
+        }
+        if (pipeline->error != NULL)
+        {
+            fprintf(stderr, "%s\n", pipeline->error);
+            exitCode = EXIT_USAGE;
+        }
+        else if (!runBuiltin(pipeline, &exitCode))
+        {
+            exitCode = processPipeline(pipeline);
+        }
+        commandsRun++;
+        if (exitCode != 0)
         {
-            killChildProcess();
-            writeToStdout("Bwahaha ... tonight I dine on turtle soup\n");
+            commandsFailed++;
         }
     }
+    // the command and everything built from it, unless it came from the cache
+    struct timespec cleanup;
+    phaseStart(&cleanup);
+    arena_reset(commandArena);
+    phaseEnd(PHASE_CLEANUP, &cleanup);
+    return !exitRequested;
 }
 
-/* Signal handler for SIGINT. Catches SIGINT signal (e.g. Ctrl + C) and
- * kills the child process if it exists and is executing. Does not
- * do anything to the parent process and its execution */
-void sigintHandler(int sig)
+/* Converts a wait status into a shell exit code: the exit status of the
+ * process, or 128 plus the signal that killed it */
+int exitCodeOf(int status)
 {
-    if (childPid != 0)
+    if (WIFSIGNALED(status))
     {
-        killChildProcess();
+        return 128 + WTERMSIG(status);
     }
+    return WEXITSTATUS(status);
 }
 
-/* Registers SIGALRM and SIGINT handlers with corresponding functions.
- * Error checks for signal system call failure and exits program if
- * there is an error */
-void registerSignalHandlers()
+/* Child side of the fork path, once the redirections are in place: executes
+ * the stage, or runs it as a builtin in this process and exits with its exit
+ * code. Never returns */
+void executeStage(STAGE *stage)
 {
-    if (signal(SIGINT, sigintHandler) == SIG_ERR)
+    struct builtin *builtin = findBuiltin(stage->argv[0]);
+    if (builtin != NULL)
     {
-        perror("Error in signal");
+        // exit() flushes what the builtin printed
+        exit(builtin->function(stage->argv));
+    }
+    // the parent resolved argv[0] before forking, so this is a cache hit
+    const char *path = path_cache_lookup(commandPaths, stage->argv[0]);
+    if (path == NULL || execv(path, stage->argv) == -1)
+    {
+        perror("Error in execv");
         exit(EXIT_FAILURE);
     }
-    if (signal(SIGALRM, alarmHandler) == SIG_ERR)
+}
+
+/* Starts a command with its standard input and output connected to the given
+ * descriptors (-1 keeps the shell's own), then applies the command's file
+ * redirections on top. The child joins the process group pgid, or leads a new
+ * one when pgid is 0, with the signal dispositions and mask of a fresh process.
+ * Returns the child's pid, or -1 if nothing was started.
+ *
+ * Commands are started with posix_spawn, which does not copy the shell's page
+ * tables the way fork does; the redirection files are opened here and moved
+ * into place by the spawn file actions, one dup2 per descriptor that changes.
+ * The descriptors passed in and the files opened here are close-on-exec, so
+ * the child only keeps its 0, 1 and 2 and needs no close actions. Systems
+ * without posix_spawn fall back to fork + executeStage.
+ *
+ * The executable comes from the PATH cache instead of a PATH search per
+ * command. If it has disappeared since it was cached, the entry is dropped
+ * and the search is repeated once */
+pid_t launchCommand(STAGE *stage, int inputFd, int outputFd, pid_t pgid)
+{
+#ifdef _POSIX_SPAWN
+    char **args = stage->argv;
+    struct redirectionPlan plan;
+    if (planRedirections(stage, inputFd, outputFd, &plan) == -1)
+    {
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = redirectionOrder[i];
+        if (plan.source[fd] != -1)
+        {
+            posix_spawn_file_actions_adddup2(&actions, plan.source[fd], fd);
+        }
+    }
+    // the shell ignores the stop signals and blocks SIGCHLD; its job must not
+    posix_spawnattr_t attributes;
+    sigset_t signals;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                              POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attributes, pgid);
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGQUIT);
+    sigaddset(&signals, SIGTSTP);
+    sigaddset(&signals, SIGTTIN);
+    sigaddset(&signals, SIGTTOU);
+    sigaddset(&signals, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attributes, &signals);
+
+    pid_t pid;
+    int error;
+    const char *path = path_cache_lookup(commandPaths, args[0]);
+    if (path == NULL)
+    {
+        error = errno;
+    }
+    else
+    {
+        error = posix_spawn(&pid, path, &actions, &attributes, args, environ);
+        if (error == ENOENT && path != args[0])
+        {
+            path_cache_forget(commandPaths, args[0]);
+            path = path_cache_lookup(commandPaths, args[0]);
+            error = path == NULL ? errno : posix_spawn(&pid, path, &actions, &attributes, args, environ);
+        }
+    }
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    closeRedirections(&plan);
+    if (error != 0)
     {
-        perror("Error in alarm signal");
+        errno = error;
+        perror("Error in posix_spawn");
+        return -1;
+    }
+    return pid;
+#else
+    return forkCommand(stage, inputFd, outputFd, pgid);
+#endif
+}
+
+/* Starts a command the way launchCommand does, in a forked copy of the shell
+ * that moves the descriptors into place and then executes the command, or
+ * runs it if it is a builtin. Used without posix_spawn and for builtins that
+ * are part of a pipeline or a background job */
+pid_t forkCommand(STAGE *stage, int inputFd, int outputFd, pid_t pgid)
+{
+    if (findBuiltin(stage->argv[0]) == NULL)
+    {
+        // resolve in the parent so the entry stays cached for the next command
+        path_cache_lookup(commandPaths, stage->argv[0]);
+    }
+    // the files are opened here, as for posix_spawn, so a missing one is
+    // reported before anything is started
+    struct redirectionPlan plan;
+    if (planRedirections(stage, inputFd, outputFd, &plan) == -1)
+    {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Error in creating child process");
         exit(EXIT_FAILURE);
     }
+    else if (pid == 0)
+    {
+        resetChildProcess(pgid);
+        applyRedirections(&plan);
+        executeStage(stage);
+    }
+    closeRedirections(&plan);
+    // set the group on both sides, whichever runs first
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+/* Child side of a fork: joins the process group pgid (a new one when pgid is
+ * 0) and drops the shell's signal handling, as posix_spawn does for a spawned
+ * command */
+void resetChildProcess(pid_t pgid)
+{
+    setpgid(0, pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+}
+
+/* Tells whether a pipeline stage is a plain cat of at most one file, which
+ * the shell runs itself as a copy instead of starting cat */
+int isCopyStage(STAGE *stage)
+{
+    // options and several files are left to cat
+    return strcmp(stage->argv[0], "cat") == 0 && stage->argc <= 2 &&
+           (stage->argc == 1 || stage->argv[1][0] != '-');
 }
 
-/* Prints the shell prompt and waits for input from user.
- * Takes timeout as an argument and starts an alarm of that timeout period
- * if there is a valid command. It then creates a child process which
- * executes the command with its arguments.
+/* Starts a copy stage: a forked shell process that copies the file named by
+ * cat's operand (or its < redirection, or its standard input) to its standard
+ * output with pipe_copy, so the data moves through the pipes with splice
+ * instead of being read into and written out of a cat process. Takes the
+ * same arguments as launchCommand and reports a missing input file the way
+ * cat would */
+pid_t launchCopy(STAGE *stage, int inputFd, int outputFd, pid_t pgid)
+{
+    // like cat, the operand is read instead of standard input; it is opened
+    // in the child, the other redirections here
+    char *inputFile = stage->argc > 1 ? stage->argv[1] : stage->input;
+    STAGE outputs = *stage;
+    outputs.input = NULL;
+    struct redirectionPlan plan;
+    if (planRedirections(&outputs, inputFd, outputFd, &plan) == -1)
+    {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Error in creating child process");
+        exit(EXIT_FAILURE);
+    }
+    else if (pid == 0)
+    {
+        resetChildProcess(pgid);
+        applyRedirections(&plan);
+        if (inputFile != NULL)
+        {
+            int in = open(inputFile, O_RDONLY | O_CLOEXEC);
+            if (in == -1)
+            {
+                perror(inputFile);
+                _exit(EXIT_FAILURE);
+            }
+            if (dup2(in, STDIN_FILENO) == -1)
+            {
+                perror("invalid: dup2 failed");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        // nothing is exec'd, so drop every other descriptor the shell holds by
+        // hand: a pipe end kept open here would stop the pipeline from ending
+        closefrom(STDERR_FILENO + 1);
+        if (pipe_copy(STDIN_FILENO, STDOUT_FILENO) == -1)
+        {
+            perror("cat");
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    closeRedirections(&plan);
+    // set the group on both sides, whichever runs first
+    setpgid(pid, pgid == 0 ? pid : pgid);
+    return pid;
+}
+
+/* Runs a pipeline of any number of stages as one job. Every stage is started
+ * before the shell waits for any of them, each one connected to the next by
+ * its own pipe, so data streams through all stages at the same time. The
+ * parser has already checked that only the first stage redirects standard
+ * input and only the last standard output. A plain cat stage is run by the
+ * shell as a spliced copy (launchCopy), and a builtin stage in a forked copy
+ * of the shell.
  *
- * The parent process waits for the child. On unsuccessful completion,
- * it exits the shell. */
-void executeShell()
+ * With a trailing & the job runs in the background and the shell returns to
+ * the prompt at once; otherwise the exit code of the last stage is returned,
+ * as in sh */
+int processPipeline(PIPELINE *pipeline)
 {
-    char **commandArray;
-    char minishell[] = "penn-sh> ";
-    writeToStdout(minishell);
+    int stageCount = pipeline->nstages;
+    STAGE *stages = pipeline->stages;
+    JOB *job = job_create(pipeline->text, stageCount, pipeline->background);
+    if (job == NULL)
+    {
+        perror("invalid: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    int lastStarted = 0;
 
-    commandArray = getCommandFromInput();
-    // check for empty command
-    if (commandArray[0] != NULL)
+    int fd[2];
+    // read end of the pipe from the previous stage
+    int inputFd = -1;
+    for (int i = 0; i < stageCount; i++)
     {
-        if (isPipe(commandArray) != 0)
+        int isLast = (i == stageCount - 1);
+        // close-on-exec, so no stage inherits pipe ends of the others
+        if (!isLast && pipe2(fd, O_CLOEXEC) == -1)
         {
-            processPipe(commandArray);
+            perror("invalid: pipe failed");
+            exit(EXIT_FAILURE);
+        }
+        if (!isLast && pipeSize != 0 && pipe_resize(fd[1], pipeSize) == -1)
+        {
+            // keep the default capacity, and do not try again
+            perror("Error in F_SETPIPE_SZ");
+            pipeSize = 0;
+        }
+
+        // STDIN -> previous pipe read, STDOUT -> next pipe write; a stage that
+        // fails to start leaves its neighbours with a closed pipe, as in sh.
+        // The first stage started leads the job's process group
+        pid_t pid;
+        struct timespec launch;
+        phaseStart(&launch);
+        if (stageCount > 1 && isCopyStage(&stages[i]))
+        {
+            pid = launchCopy(&stages[i], inputFd, isLast ? -1 : fd[1], job->pgid);
+        }
+        else if (findBuiltin(stages[i].argv[0]) != NULL)
+        {
+            pid = forkCommand(&stages[i], inputFd, isLast ? -1 : fd[1], job->pgid);
         }
         else
         {
-            processRedirections(commandArray);
+            pid = launchCommand(&stages[i], inputFd, isLast ? -1 : fd[1], job->pgid);
+        }
+        phaseEnd(PHASE_LAUNCH, &launch);
+        if (pid != -1)
+        {
+            job_add_process(job, pid);
+        }
+        if (isLast)
+        {
+            lastStarted = (pid != -1);
+        }
+
+        // the parent keeps only the read end the next stage needs
+        if (inputFd != -1)
+        {
+            close(inputFd);
+        }
+        if (!isLast)
+        {
+            close(fd[1]);
+            inputFd = fd[0];
+        }
+    }
+
+    if (job->nprocs == 0)
+    {
+        job_remove(job);
+        return EXIT_NOT_STARTED;
+    }
+    armJobTimeout(job);
+    if (pipeline->background)
+    {
+        if (interactive)
+        {
+            printf("[%d] %d\n", job->id, (int)job->pgid);
+            fflush(stdout);
         }
+        return 0;
+    }
+    struct timespec wait;
+    phaseStart(&wait);
+    int exitCode = waitForForegroundJob(job);
+    phaseEnd(PHASE_WAIT, &wait);
+    return lastStarted ? exitCode : EXIT_NOT_STARTED;
+}
+
+/* Joins the tokens of a command with single spaces, for the job listing */
+char *joinTokens(char **commandArray)
+{
+    size_t length = 1;
+    for (int i = 0; commandArray[i] != NULL; i++)
+    {
+        length += strlen(commandArray[i]) + 1;
     }
+    char *command = allocateFromArena(length);
+    char *end = command;
     for (int i = 0; commandArray[i] != NULL; i++)
     {
-        free(commandArray[i]);
+        if (i > 0)
+        {
+            *end++ = ' ';
+        }
+        size_t tokenLength = strlen(commandArray[i]);
+        memcpy(end, commandArray[i], tokenLength);
+        end += tokenLength;
+    }
+    *end = '\0';
+    return command;
+}
+
+/* Runs a job in the foreground: hands it the terminal, continues it if it was
+ * stopped and runs the event loop until all of its processes have exited or
+ * stopped. A finished job is removed and its exit code returned; a job
+ * stopped with Ctrl + Z stays in the table as a background job */
+int waitForForegroundJob(JOB *job)
+{
+    job->background = 0;
+    foregroundJob = job;
+    if (terminalFd != -1)
+    {
+        tcsetpgrp(terminalFd, job->pgid);
+    }
+    // also wakes a stage that read the terminal before it was handed over
+    if (terminalFd != -1 || job_is_stopped(job))
+    {
+        kill(-job->pgid, SIGCONT);
+        job_mark_running(job);
+    }
+
+    while (!job_is_done(job) && !job_is_stopped(job))
+    {
+        waitForEvents(-1);
+    }
+    foregroundJob = NULL;
+    if (terminalFd != -1)
+    {
+        tcsetpgrp(terminalFd, shellPgid);
+    }
+
+    if (!job_is_done(job))
+    {
+        job->background = 1;
+        printJob(job, "Stopped");
+        return 128 + SIGTSTP;
+    }
+    int exitCode = exitCodeOf(job_status(job));
+    finishJob(job);
+    return exitCode;
+}
+
+/* One round of the event loop: sleeps until a child changes state, a job
+ * deadline passes, a signal interrupts the wait or fd (unless -1) becomes
+ * readable. Children are reaped into the job table and expired deadlines are
+ * acted on before returning. Returns 1 if fd is ready to read, 0 otherwise.
+ *
+ * SIGCHLD is blocked all the time and read from the signalfd, so a child that
+ * exits between checking the job table and this call still wakes the shell */
+int waitForEvents(int fd)
+{
+    struct pollfd events[3];
+    events[0].fd = childSignalFd;
+    events[1].fd = timerFd;
+    events[2].fd = fd;
+    for (int i = 0; i < 3; i++)
+    {
+        events[i].events = POLLIN;
+        events[i].revents = 0;
+    }
+    if (poll(events, fd != -1 ? 3 : 2, -1) == -1)
+    {
+        if (errno == EINTR)
+        {
+            return 0;
+        }
+        perror("Error in poll");
+        exit(EXIT_FAILURE);
+    }
+
+    if (events[0].revents != 0)
+    {
+        // one queued SIGCHLD can stand for any number of exited children
+        struct signalfd_siginfo info;
+        while (read(childSignalFd, &info, sizeof(info)) == sizeof(info))
+        {
+        }
+        job_reap_children();
+    }
+    if (events[1].revents != 0)
+    {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        {
+            handleTimeouts();
+        }
+    }
+    return fd != -1 && events[2].revents != 0;
+}
+
+/* Wait hook of the input reader: runs the event loop at the prompt until the
+ * input is readable, so background jobs are reaped and timed out meanwhile */
+int waitForInput(int fd, void *arg)
+{
+    (void)arg;
+    while (!waitForEvents(fd))
+    {
+    }
+    return 0;
+}
+
+/* Gives a job that was just started its deadline, if -t is set */
+void armJobTimeout(JOB *job)
+{
+    if (commandTimeout == 0)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+    job->deadline.tv_sec += commandTimeout / 1000;
+    job->deadline.tv_nsec += (commandTimeout % 1000) * 1000000;
+    if (job->deadline.tv_nsec >= 1000000000)
+    {
+        job->deadline.tv_sec++;
+        job->deadline.tv_nsec -= 1000000000;
+    }
+    job->timeout = JOB_TIMEOUT_ARMED;
+    armTimer();
+}
+
+/* Acts on every deadline that has passed: a job past its timeout gets SIGTERM
+ * (and SIGCONT, in case it is stopped) and a new deadline after the grace
+ * period; a job still running after that gets SIGKILL. Signals go to the
+ * job's process group, so every stage of a pipeline is terminated */
+void handleTimeouts()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (JOB *job = job_first(); job != NULL; job = job->next)
+    {
+        if (job->timeout == JOB_TIMEOUT_NONE || job_is_done(job) || job->pgid <= 0 ||
+            secondsBetween(&now, &job->deadline) > 0)
+        {
+            continue;
+        }
+        if (job->timeout == JOB_TIMEOUT_ARMED)
+        {
+            kill(-job->pgid, SIGTERM);
+            kill(-job->pgid, SIGCONT);
+            if (job == foregroundJob)
+            {
+                writeToStdout("Bwahaha ... tonight I dine on turtle soup\n");
+            }
+            job->deadline = now;
+            job->deadline.tv_sec += killGrace / 1000;
+            job->deadline.tv_nsec += (killGrace % 1000) * 1000000;
+            if (job->deadline.tv_nsec >= 1000000000)
+            {
+                job->deadline.tv_sec++;
+                job->deadline.tv_nsec -= 1000000000;
+            }
+            job->timeout = JOB_TIMEOUT_TERMINATED;
+        }
+        else
+        {
+            kill(-job->pgid, SIGKILL);
+            job->timeout = JOB_TIMEOUT_NONE;
+        }
+    }
+    armTimer();
+}
+
+/* Sets the timer to the earliest deadline of a running job, or disarms it */
+void armTimer()
+{
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    for (JOB *job = job_first(); job != NULL; job = job->next)
+    {
+        if (job->timeout != JOB_TIMEOUT_NONE && !job_is_done(job) &&
+            (timer.it_value.tv_sec == 0 || secondsBetween(&job->deadline, &timer.it_value) > 0))
+        {
+            timer.it_value = job->deadline;
+        }
+    }
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL) == -1)
+    {
+        perror("Error in timerfd_settime");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns the number of milliseconds in text, or -1 if it is not one */
+long parseMilliseconds(const char *text)
+{
+    char *end;
+    errno = 0;
+    long milliseconds = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || milliseconds < 0 || errno != 0)
+    {
+        return -1;
+    }
+    return milliseconds;
+}
+
+/* Collects children the event loop has not seen yet, then prints and
+ * removes every finished job. Called before each prompt, so the shell never
+ * blocks for a background job. A failed job counts as a failed command */
+void reportFinishedJobs()
+{
+    job_reap_children();
+    JOB *job = job_first();
+    while (job != NULL)
+    {
+        JOB *next = job->next;
+        if (job_is_done(job))
+        {
+            int exitCode = exitCodeOf(job_status(job));
+            if (exitCode != 0)
+            {
+                commandsFailed++;
+            }
+            if (interactive)
+            {
+                char state[32];
+                if (exitCode == 0)
+                {
+                    strcpy(state, "Done");
+                }
+                else
+                {
+                    snprintf(state, sizeof(state), "Exit %d", exitCode);
+                }
+                printJob(job, state);
+            }
+            finishJob(job);
+        }
+        job = next;
+    }
+}
+
+/* Removes a job that is done from the table, reporting its resource usage
+ * first if that was asked for */
+void finishJob(JOB *job)
+{
+    if (timeCommands || statsFile != NULL)
+    {
+        reportJobUsage(job);
+    }
+    job_remove(job);
+}
+
+/* Reports what every process of a finished job used, from the rusage wait4
+ * returned when the event loop reaped it. The wall time runs from the
+ * start of the process to the moment it was reaped */
+void reportJobUsage(JOB *job)
+{
+    for (int i = 0; i < job->nprocs; i++)
+    {
+        JOB_PROCESS *process = &job->procs[i];
+        double real = secondsBetween(&process->started, &process->finished);
+        double user = process->usage.ru_utime.tv_sec + process->usage.ru_utime.tv_usec / 1e6;
+        double sys = process->usage.ru_stime.tv_sec + process->usage.ru_stime.tv_usec / 1e6;
+        int exitCode = exitCodeOf(process->status);
+        if (timeCommands)
+        {
+            fprintf(stderr,
+                    "time: %s [%d/%d]: exit %d, %.3fs real, %.3fs user, %.3fs sys, "
+                    "%ldKB max rss, %ld minor + %ld major faults\n",
+                    job->command, i + 1, job->nprocs, exitCode, real, user, sys,
+                    process->usage.ru_maxrss, process->usage.ru_minflt, process->usage.ru_majflt);
+        }
+        if (statsFile != NULL)
+        {
+            fprintf(statsFile, "%s\t%d\t%d\t%d\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\n", job->command,
+                    i + 1, (int)process->pid, exitCode, real, user, sys, process->usage.ru_maxrss,
+                    process->usage.ru_minflt, process->usage.ru_majflt);
+        }
+    }
+    if (statsFile != NULL)
+    {
+        // a line per command even if the shell is killed later
+        fflush(statsFile);
+    }
+}
+
+/* Prints one line of the job listing, marking the current job with + */
+void printJob(JOB *job, const char *state)
+{
+    printf("[%d]%c  %-22s %s\n", job->id, job == job_current() ? '+' : ' ', state, job->command);
+    fflush(stdout);
+}
+
+/* Returns the job named by a builtin argument, %n or n, or the current job
+ * when there is no argument. Reports the error and returns NULL if there is
+ * no such job */
+JOB *findJobFromArgument(const char *name, char *argument)
+{
+    JOB *job;
+    if (argument == NULL)
+    {
+        job = job_current();
+    }
+    else
+    {
+        char *end;
+        long id = strtol(argument[0] == '%' ? argument + 1 : argument, &end, 10);
+        job = *end == '\0' ? job_find((int)id) : NULL;
+    }
+    if (job == NULL)
+    {
+        fprintf(stderr, "%s: %s: no such job\n", name, argument != NULL ? argument : "current");
+    }
+    return job;
+}
+
+/* Builtins, looked up by the first token of a command */
+struct builtin builtins[] = {
+    {"cd", builtinCd},
+    {"echo", builtinEcho},
+    {"pwd", builtinPwd},
+    {"exit", builtinExit},
+    {"true", builtinTrue},
+    {"false", builtinFalse},
+    {"jobs", builtinJobs},
+    {"fg", builtinFg},
+    {"bg", builtinBg},
+    {"wait", builtinWait},
+    {"parallel", builtinParallel},
+    {"history", builtinHistory},
+    {"stats", builtinStats},
+};
+
+// the builtins by builtinHash of their names; every slot holds at most one
+struct builtin *builtinTable[BUILTIN_TABLE_SIZE];
+
+/* Fills the builtin hash table. builtinHash is chosen so that no two builtins
+ * share a slot; a new builtin that collides stops the shell at startup */
+void initBuiltins()
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        unsigned int slot = builtinHash(builtins[i].name);
+        if (builtinTable[slot] != NULL)
+        {
+            fprintf(stderr, "penn-shredder: builtins %s and %s collide in builtinHash\n",
+                    builtinTable[slot]->name, builtins[i].name);
+            exit(EXIT_FAILURE);
+        }
+        builtinTable[slot] = &builtins[i];
+    }
+}
+
+/* Perfect hash of the builtin names, from their first and last letters and
+ * their length */
+unsigned int builtinHash(const char *name)
+{
+    size_t length = strlen(name);
+    return ((unsigned char)name[0] + 2 * (unsigned char)name[length - 1] + length) % BUILTIN_TABLE_SIZE;
+}
+
+/* Returns the builtin called name, or NULL: one hash and one string compare */
+struct builtin *findBuiltin(const char *name)
+{
+    struct builtin *builtin = builtinTable[builtinHash(name)];
+    if (builtin == NULL || strcmp(builtin->name, name) != 0)
+    {
+        return NULL;
+    }
+    return builtin;
+}
+
+/* Runs the command in the shell itself if it names a builtin, storing its
+ * exit code. Its redirections are applied by swapping the shell's standard
+ * input, output and error for the duration of the builtin. Returns 0 if the
+ * command is not a builtin, or is part of a pipeline or a background job and
+ * so has to run in a process of its own */
+int runBuiltin(PIPELINE *pipeline, int *exitCode)
+{
+    STAGE *stage = &pipeline->stages[0];
+    if (pipeline->nstages > 1 || pipeline->background)
+    {
+        return 0;
+    }
+    struct builtin *builtin = findBuiltin(stage->argv[0]);
+    if (builtin == NULL)
+    {
+        return 0;
+    }
+
+    struct timespec start;
+    phaseStart(&start);
+    struct redirectionPlan plan;
+    int saved[3];
+    if (planRedirections(stage, -1, -1, &plan) == -1)
+    {
+        *exitCode = EXIT_FAILURE;
+        return 1;
+    }
+    int swapped = swapStandardFds(&plan, saved);
+    closeRedirections(&plan);
+    if (swapped == -1)
+    {
+        *exitCode = EXIT_FAILURE;
+        return 1;
+    }
+    *exitCode = builtin->function(stage->argv);
+    // what the builtin printed belongs in the file, not in the shell's stdout
+    fflush(stdout);
+    restoreStandardFds(saved);
+    phaseEnd(PHASE_BUILTIN, &start);
+    return 1;
+}
+
+/* Points the shell's own standard input, output and error where the plan
+ * says, for a builtin that runs in the shell, and keeps close-on-exec copies
+ * of what they pointed at before in saved (-1 where nothing changes) for
+ * restoreStandardFds. Returns -1 after reporting the error, with everything
+ * restored */
+int swapStandardFds(struct redirectionPlan *plan, int saved[3])
+{
+    saved[STDIN_FILENO] = saved[STDOUT_FILENO] = saved[STDERR_FILENO] = -1;
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = redirectionOrder[i];
+        if (plan->source[fd] == -1)
+        {
+            continue;
+        }
+        // above the descriptors the shell's children see
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        if (saved[fd] == -1 || dup2(plan->source[fd], fd) == -1)
+        {
+            // report it where standard error was
+            int error = errno;
+            restoreStandardFds(saved);
+            errno = error;
+            perror("invalid: dup2 failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Undoes swapStandardFds */
+void restoreStandardFds(int saved[3])
+{
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+    {
+        if (saved[fd] == -1)
+        {
+            continue;
+        }
+        if (dup2(saved[fd], fd) == -1)
+        {
+            perror("invalid: dup2 failed");
+            exit(EXIT_FAILURE);
+        }
+        close(saved[fd]);
     }
-    free(commandArray);
 }
 
-void processRedirections(char **commandArray)
+/* cd [dir]: changes the shell's working directory, to $HOME by default */
+int builtinCd(char **argv)
 {
-    int status;
-    childPid = fork();
-    if (childPid < 0)
+    const char *dir = argv[1] != NULL ? argv[1] : getenv("HOME");
+    if (dir == NULL)
     {
-        perror("Error in creating child process");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
     }
-    else if (childPid == 0)
+    if (chdir(dir) == -1)
     {
-        // child process
-        executeRedirections(commandArray);
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
     }
-    else
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
     {
-        // parent process
-        // wait for the child process to terminate
-        do
-        {
-            if (wait(&status) == -1)
-            {
-                // check for errors in waiting for child process
-                perror("Error in child process termination");
-                exit(EXIT_FAILURE);
-            }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-        // reset the childPid
-        childPid = 0;
+        setenv("PWD", cwd, 1);
     }
+    // commands found through relative PATH directories are elsewhere now
+    path_cache_forget_relative(commandPaths);
+    return 0;
 }
 
-void executeRedirections(char **commandArray)
+/* echo [-n] [args]: prints the arguments separated by spaces */
+int builtinEcho(char **argv)
 {
-    char **args = (char **)malloc(sizeof(char *) * INPUT_SIZE);
-    int commandArrayPtr = 0;
-    char *command;
-    int inputRedirectionCount = 0;
-    int outputRedirectionCount = 0;
-    // iterate through the command array
-    int argsPtr = 0;
-    for (;;)
+    int first = 1;
+    int newline = 1;
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0)
     {
-        command = commandArray[commandArrayPtr++];
-        if (command == NULL)
-        {
-            // end of the command array
-            args[argsPtr] = NULL;
-            break;
-        }
-        else if (strcmp(command, ">") == 0)
-        {
-            if (inputRedirectionCount > 0)
-            {
-                perror("Invalid: Multiple standard output redirects");
-                exit(EXIT_FAILURE);
-            }
-            command = commandArray[commandArrayPtr++];
-            // redirect standard output to file
-            redirctionsSTDOUTtoFile(command);
-            inputRedirectionCount++;
-        }
-        else if (strcmp(command, "<") == 0)
-        {
-            if (outputRedirectionCount > 0)
-            {
-                perror("Invalid: Multiple standard input redirects");
-                exit(EXIT_FAILURE);
-            }
-            command = commandArray[commandArrayPtr++];
-            // redirect standard input to file
-            redirectionsSTDINtoFile(command);
-            outputRedirectionCount++;
-        }
-        else
+        newline = 0;
+        first = 2;
+    }
+    for (int i = first; argv[i] != NULL; i++)
+    {
+        if (i > first)
         {
-            // add the command to the args
-            args[argsPtr++] = command;
+            putchar(' ');
         }
+        fputs(argv[i], stdout);
     }
-
-    if (execvp(args[0], args) == -1)
+    if (newline)
     {
-        perror("Error in execvp");
-        exit(EXIT_FAILURE);
+        putchar('\n');
     }
-    // free the memory
-    free(args);
+    fflush(stdout);
+    return 0;
 }
 
-void processPipe(char **commandArray)
+/* pwd: prints the working directory */
+int builtinPwd(char **argv)
 {
+    (void)argv;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    fflush(stdout);
+    return 0;
+}
 
-    char **commandArray1 = createArrayOfTokensBeforePipe(commandArray);
-    char **commandArray2 = createArrayOfTokensAfterPipe(commandArray);
-
-    // for (int i = 0; commandArray1[i] != NULL; i++)
-    // {
-    //     printf("commandArray1[%d] = %s\n", i, commandArray1[i]);
-    // }
-    // for (int i = 0; commandArray2[i] != NULL; i++)
-    // {
-    //     printf("commandArray2[%d] = %s\n", i, commandArray2[i]);
-    // }
+/* exit [n]: leaves the shell with exit code n, 0 by default */
+int builtinExit(char **argv)
+{
+    exitRequested = 1;
+    shellExitCode = argv[1] != NULL ? atoi(argv[1]) & 0xff : 0;
+    return shellExitCode;
+}
 
-    char **args1;
-    char **args2;
+/* true: does nothing, successfully */
+int builtinTrue(char **argv)
+{
+    (void)argv;
+    return 0;
+}
 
-    int fd[2];
+/* false: does nothing, unsuccessfully */
+int builtinFalse(char **argv)
+{
+    (void)argv;
+    return 1;
+}
 
-    if (pipe(fd) == -1)
+/* jobs: lists the jobs that are running or stopped */
+int builtinJobs(char **argv)
+{
+    (void)argv;
+    job_reap_children();
+    for (JOB *job = job_first(); job != NULL; job = job->next)
     {
-        perror("invalid: pipe failed");
-        exit(EXIT_FAILURE);
+        printJob(job, job_is_done(job) ? "Done" : job_is_stopped(job) ? "Stopped" : "Running");
     }
+    return 0;
+}
 
-    if ((childPid1 = fork()) < 0)
-    {
-        perror("invalid: fork failed");
-        exit(EXIT_FAILURE);
-    }
-    else if (childPid1 == 0)
+/* fg [job]: continues a job in the foreground and waits for it */
+int builtinFg(char **argv)
+{
+    JOB *job = findJobFromArgument(argv[0], argv[1]);
+    if (job == NULL)
     {
-        // redirect the standard input to the file
-        args1 = redirectionsPipeWriterProcess(commandArray1, fd);
-
-        // for (int i = 0; args1[i] != NULL; i++)
-        // {
-        //     printf("args[%d] = %s\n", i, args1[i]);
-        // }
-        // execute the command
-        if (execvp(args1[0], args1) == -1)
-        {
-            perror("Error in execvp");
-            exit(EXIT_FAILURE);
-        }
+        return 1;
     }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    return waitForForegroundJob(job);
+}
 
-    if ((childPid2 = fork()) < 0)
+/* bg [job]: continues a stopped job in the background */
+int builtinBg(char **argv)
+{
+    JOB *job = findJobFromArgument(argv[0], argv[1]);
+    if (job == NULL)
     {
-        perror("invalid: fork failed");
-        exit(EXIT_FAILURE);
+        return 1;
     }
-    else if (childPid2 == 0)
+    job->background = 1;
+    if (kill(-job->pgid, SIGCONT) == -1 && errno != ESRCH)
     {
-        args2 = redirectionsPipeReaderProcess(commandArray2, fd);
-
-        // for (int i = 0; args2[i] != NULL; i++)
-        // {
-        //     printf("args[%d] = %s\n", i, args2[i]);
-        // }
-        if (execvp(args2[0], args2) == -1)
-        {
-            perror("Error in execvp");
-            exit(EXIT_FAILURE);
-        }
+        perror("Error in kill");
+        return 1;
     }
-    close(fd[0]);
-    close(fd[1]);
-    int status;
-    waitpid(childPid1, &status, 0);
-    waitpid(childPid2, &status, 0);
-    childPid1 = 0;
-    childPid2 = 0;
-
-    free(commandArray1);
-    free(commandArray2);
+    job_mark_running(job);
+    printf("[%d]+ %s &\n", job->id, job->command);
+    fflush(stdout);
+    return 0;
 }
 
-char **redirectionsPipeWriterProcess(char **commandArrayBeforePipe, int *fd)
+/* wait [job]: waits until the job, or every job, has finished, and returns
+ * the exit code of the job waited for. Stopped jobs are not waited for */
+int builtinWait(char **argv)
 {
-
-    int inputRedirectionCount = 0;
-    char **args = (char **)malloc(sizeof(char *) * INPUT_SIZE);
-    char *file;
-    // X -> pipe read
-    close(fd[0]);
-    // check memory allocation
-    if (args == NULL)
+    JOB *job = NULL;
+    if (argv[1] != NULL && (job = findJobFromArgument(argv[0], argv[1])) == NULL)
     {
-        perror("invalid: malloc failed");
-        exit(EXIT_FAILURE);
+        return 1;
     }
-    int inputRedirectionIndex = -1;
 
-    for (int i = 0; commandArrayBeforePipe[i] != NULL; i++)
+    for (;;)
     {
-        if (strcmp(commandArrayBeforePipe[i], ">") == 0)
+        int waiting = 0;
+        for (JOB *other = job_first(); other != NULL; other = other->next)
         {
-            perror("Invalid: Standard input redirect not allowed in pipe writer process");
-            exit(EXIT_FAILURE);
+            if ((job == NULL || other == job) && !job_is_done(other) && !job_is_stopped(other))
+            {
+                waiting = 1;
+            }
         }
-        else if (strcmp(commandArrayBeforePipe[i], "<") == 0)
+        if (!waiting)
         {
-            inputRedirectionIndex = i;
-            inputRedirectionCount++;
+            break;
         }
+        waitForEvents(-1);
     }
-    if (inputRedirectionCount > 1)
+    if (job == NULL || !job_is_done(job))
     {
-        perror("Invalid: Multiple standard output redirects");
-        exit(EXIT_FAILURE);
+        return 0;
     }
+    // reported here instead of at the next prompt
+    int exitCode = exitCodeOf(job_status(job));
+    finishJob(job);
+    return exitCode;
+}
 
-    if (inputRedirectionIndex != -1)
+/* parallel [-j N] command [args] ::: value...
+ * Runs the command once per value, with the value appended as its last
+ * argument, keeping at most N instances (default: one per online CPU)
+ * running at once. Instances start through launchCommand, so they take the
+ * same exec path as any other command; the redirections of the parallel
+ * line apply to all of them.
+ *
+ * All instances form one foreground job: Ctrl + C kills the ones running and
+ * no more are started. Each instance is reported as it finishes, in completion
+ * order, with its exit code and wall time, followed by a summary. Returns the
+ * number of failed instances, at most 101, like GNU parallel */
+int builtinParallel(char **argv)
+{
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (argv[first] != NULL && strncmp(argv[first], "-j", 2) == 0)
     {
-        for (int i = 0; i < inputRedirectionIndex; i++)
+        char *value = argv[first][2] != '\0' ? &argv[first][2] : argv[++first];
+        char *end = NULL;
+        slots = value != NULL ? strtol(value, &end, 10) : 0;
+        if (end == NULL || *end != '\0' || slots < 1)
         {
-            args[i] = commandArrayBeforePipe[i];
-        }
-        args[inputRedirectionIndex] = NULL;
-        file = commandArrayBeforePipe[inputRedirectionIndex + 1];
-        // STDIN -> file
-        int fileDescriptor = redirectionsSTDINtoFile(file);
-
-        // STDOUT -> pipe write
-        if (dup2(fd[1], STDOUT_FILENO) == -1)
-        {
-            perror("invalid: dup2 failed");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            return EXIT_USAGE;
         }
-        close(fd[1]);
+        first++;
     }
-    else
+    int separator = first;
+    while (argv[separator] != NULL && strcmp(argv[separator], ":::") != 0)
     {
-
-        int i = 0;
-        for (; commandArrayBeforePipe[i] != NULL; i++)
-        {
-            args[i] = commandArrayBeforePipe[i];
-        }
-        args[i] = NULL;
-
-        if (dup2(fd[1], STDOUT_FILENO) == -1)
-        {
-            perror("invalid: dup2 failed");
-            exit(EXIT_FAILURE);
-        }
-        close(fd[1]);
+        separator++;
     }
+    int templateLength = separator - first;
+    int count = argv[separator] != NULL ? countTokens(&argv[separator + 1]) : 0;
+    if (templateLength == 0 || count == 0)
+    {
+        fprintf(stderr, "usage: parallel [-j N] command [args] ::: value...\n");
+        return EXIT_USAGE;
+    }
+    char **values = &argv[separator + 1];
 
-    return args;
-}
-
-char **redirectionsPipeReaderProcess(char **commandArrayAfterPipe, int *fd)
-{
-    int outputRedirectionCount = 0;
-    char **args = (char **)malloc(sizeof(char *) * INPUT_SIZE);
-    char *file_str;
-    close(fd[1]);
-    // check memory allocation
-    if (args == NULL)
+    JOB *job = job_create(joinTokens(argv), count, 0);
+    if (job == NULL)
     {
         perror("invalid: malloc failed");
         exit(EXIT_FAILURE);
     }
-    int outputRedirectionIndex = -1;
-
-    for (int i = 0; commandArrayAfterPipe[i] != NULL; i++)
+    // by value: when its instance started; by process of the job: its value
+    // and whether it was reported. Processes before oldest are all reported
+    struct timespec *started = allocateFromArena(sizeof(struct timespec) * count);
+    int *valueOf = allocateFromArena(sizeof(int) * count);
+    char *reported = allocateFromArena(count);
+    int oldest = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    foregroundJob = job;
+
+    int next = 0;
+    int running = 0;
+    int finished = 0;
+    int failed = 0;
+    int interrupted = 0;
+    while (finished < count)
     {
-        if (strcmp(commandArrayAfterPipe[i], "<") == 0)
+        while (!interrupted && next < count && running < slots)
         {
-            perror("Invalid: Standard output redirect not allowed in pipe reader process");
-            exit(EXIT_FAILURE);
-        }
-        else if (strcmp(commandArrayAfterPipe[i], ">") == 0)
-        {
-            outputRedirectionIndex = i;
-            outputRedirectionCount++;
+            STAGE instance = {.argv = allocateFromArena(sizeof(char *) * (templateLength + 2)),
+                              .argc = templateLength + 1};
+            memcpy(instance.argv, &argv[first], sizeof(char *) * templateLength);
+            instance.argv[templateLength] = values[next];
+            instance.argv[templateLength + 1] = NULL;
+            // once every instance of the group was reaped the group is gone,
+            // so the next instance leads a new one
+            if (job_is_done(job))
+            {
+                job->pgid = 0;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &started[next]);
+            pid_t pid = launchCommand(&instance, -1, -1, job->pgid);
+            if (pid == -1)
+            {
+                finished++;
+                failed++;
+                printf("parallel: %s exit %d in %.3fs\n", values[next], EXIT_NOT_STARTED,
+                       secondsSince(&started[next]));
+                fflush(stdout);
+            }
+            else
+            {
+                valueOf[job->nprocs] = next;
+                reported[job->nprocs] = 0;
+                job_add_process(job, pid);
+                if (job->nprocs == 1)
+                {
+                    // the deadline of -t covers the whole fan-out
+                    armJobTimeout(job);
+                }
+                if (terminalFd != -1 && job->pgid == pid)
+                {
+                    tcsetpgrp(terminalFd, pid);
+                }
+                running++;
+            }
+            next++;
         }
-    }
-    if (outputRedirectionCount > 1)
-    {
-        perror("Invalid: Multiple standard input redirects");
-        exit(EXIT_FAILURE);
-    }
-    if (outputRedirectionIndex != -1)
-    {
-        for (int i = 0; i < outputRedirectionIndex; i++)
+        if (running == 0)
         {
-            args[i] = commandArrayAfterPipe[i];
+            // interrupted before the rest were started
+            finished = count;
+            break;
         }
-        args[outputRedirectionIndex] = NULL;
-        file_str = commandArrayAfterPipe[outputRedirectionIndex + 1];
-        int file = redirctionsSTDOUTtoFile(file_str);
 
-        // close(fd[1]);
-        if (dup2(fd[0], STDIN_FILENO) == -1)
+        waitForEvents(-1);
+        if (job_is_stopped(job))
         {
-            perror("invalid: dup2 failed");
-            exit(EXIT_FAILURE);
+            // a fan-out is not suspended; Ctrl + Z just continues it
+            kill(-job->pgid, SIGCONT);
+            job_mark_running(job);
         }
-        close(fd[0]);
-    }
-    else
-    {
-        // close(fd[1]);
-        int i = 0;
-        for (; commandArrayAfterPipe[i] != NULL; i++)
+        for (int p = oldest; p < job->nprocs; p++)
         {
-            args[i] = commandArrayAfterPipe[i];
+            if (reported[p] || job->procs[p].state != PROCESS_DONE)
+            {
+                continue;
+            }
+            int value = valueOf[p];
+            int status = job->procs[p].status;
+            int exitCode = exitCodeOf(status);
+            printf("parallel: %s exit %d in %.3fs\n", values[value], exitCode,
+                   secondsSince(&started[value]));
+            fflush(stdout);
+            reported[p] = 1;
+            running--;
+            finished++;
+            if (exitCode != 0)
+            {
+                failed++;
+            }
+            if (WIFSIGNALED(status) && (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM ||
+                                        WTERMSIG(status) == SIGKILL))
+            {
+                interrupted = 1;
+            }
         }
-        args[i] = NULL;
-
-        if (dup2(fd[0], STDIN_FILENO) == -1)
+        while (oldest < job->nprocs && reported[oldest])
         {
-            perror("invalid: dup2 failed");
-            exit(EXIT_FAILURE);
+            oldest++;
         }
+    }
+    foregroundJob = NULL;
+    if (terminalFd != -1)
+    {
+        tcsetpgrp(terminalFd, shellPgid);
+    }
+    finishJob(job);
 
-        close(fd[0]);
+    fprintf(stderr, "parallel: %d of %d run, %d failed, -j %ld, %.3fs wall\n", next, count, failed,
+            slots, secondsSince(&start));
+    return failed > 101 ? 101 : failed;
+}
+
+/* stats: prints the latency histogram of every phase recorded with -P */
+int builtinStats(char **argv)
+{
+    (void)argv;
+    if (!profilePhases)
+    {
+        fprintf(stderr, "stats: the shell was started without -P\n");
+        return EXIT_FAILURE;
     }
+    printPhases(stdout);
+    fflush(stdout);
+    return 0;
+}
 
-    return args;
+/* Names the phase histograms. They stay empty without -P */
+void initPhases()
+{
+    static const char *names[PHASE_COUNT] = {"read", "parse", "launch", "wait", "builtin", "cleanup"};
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        latency_init(&phaseLatency[phase], names[phase]);
+    }
 }
 
-char **createArrayOfTokensBeforePipe(char **commandArray)
+/* Notes when a phase starts. Without -P nothing is read, so profiling costs
+ * one test per phase when it is off */
+void phaseStart(struct timespec *start)
 {
-    char **beforePipeArray = (char **)malloc(sizeof(char **) * INPUT_SIZE);
-    // check memory allocation
-    if (beforePipeArray == NULL)
+    if (profilePhases)
     {
-        perror("invalid: malloc failed");
-        exit(EXIT_FAILURE);
+        clock_gettime(CLOCK_MONOTONIC, start);
     }
-    for (int i = 0; commandArray[i] != NULL; i++)
+}
+
+/* Records the time since phaseStart in the histogram of the phase */
+void phaseEnd(int phase, struct timespec *start)
+{
+    if (profilePhases)
     {
-        if (strcmp(commandArray[i], "|") == 0)
-        {
-            beforePipeArray[i] = NULL;
-            break;
-        }
-        else
-        {
-            beforePipeArray[i] = commandArray[i];
-        }
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latency_record(&phaseLatency[phase], (uint64_t)(end.tv_sec - start->tv_sec) * 1000000000 +
+                                                 end.tv_nsec - start->tv_nsec);
     }
-    return beforePipeArray;
 }
 
-char **createArrayOfTokensAfterPipe(char **commandArray)
+/* Prints a line per phase: how often it ran and its latency distribution */
+void printPhases(FILE *out)
 {
-    char **afterPipeArray = (char **)malloc(sizeof(char **) * INPUT_SIZE);
-    int foundPipe = 0;
-    // check memory allocation
-    if (afterPipeArray == NULL)
+    latency_print_header(out, "phase");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
     {
-        perror("invalid: malloc failed");
-        exit(EXIT_FAILURE);
+        latency_print(&phaseLatency[phase], out);
     }
-    int i = 0;
-    int j = 0;
-    for (; commandArray[i] != NULL; i++)
+}
+
+/* Returns the seconds passed since start, on the monotonic clock */
+double secondsSince(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return secondsBetween(start, &now);
+}
+
+/* Returns the seconds from start to end */
+double secondsBetween(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Works out what a stage's standard input, output and error are dup2'd from:
+ * the pipe ends passed in (-1 for the shell's own), replaced by the files the
+ * stage redirects to, which are opened here close-on-exec. 2>&1 shares the
+ * open file of standard output, as in sh, so both append to one offset.
+ * Applying the plan takes at most one dup2 per descriptor and no close.
+ * Returns -1 after reporting the error, with nothing left open */
+int planRedirections(STAGE *stage, int inputFd, int outputFd, struct redirectionPlan *plan)
+{
+    plan->source[STDIN_FILENO] = inputFd;
+    plan->source[STDOUT_FILENO] = outputFd;
+    plan->source[STDERR_FILENO] = -1;
+    plan->opened[STDIN_FILENO] = plan->opened[STDOUT_FILENO] = plan->opened[STDERR_FILENO] = -1;
+
+    char *files[3] = {stage->input, stage->output, stage->error_output};
+    int append[3] = {0, stage->append, stage->error_append};
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
     {
-        if (strcmp(commandArray[i], "|") == 0)
+        if (files[fd] == NULL)
         {
-            foundPipe = 1;
             continue;
         }
-        if (foundPipe != 0)
+        plan->opened[fd] = openRedirectionFile(files[fd], fd, append[fd]);
+        if (plan->opened[fd] == -1)
         {
-            afterPipeArray[j] = commandArray[i];
-            j++;
+            closeRedirections(plan);
+            return -1;
         }
+        plan->source[fd] = plan->opened[fd];
+    }
+
+    if (stage->error_dup == STAGE_ERROR_TO_OUTPUT)
+    {
+        plan->source[STDERR_FILENO] =
+            plan->source[STDOUT_FILENO] != -1 ? plan->source[STDOUT_FILENO] : STDOUT_FILENO;
+    }
+    else if (stage->error_dup == STAGE_ERROR_TO_INHERITED)
+    {
+        // still the old standard output: fd 2 is moved first
+        plan->source[STDERR_FILENO] = outputFd != -1 ? outputFd : STDOUT_FILENO;
     }
-    afterPipeArray[j] = NULL;
-    return afterPipeArray;
+    return 0;
 }
 
-int redirctionsSTDOUTtoFile(const char *token)
+/* Child side of the fork path: moves the planned descriptors into place, in
+ * redirectionOrder */
+void applyRedirections(struct redirectionPlan *plan)
 {
-    return redirectionToFile(token, STDOUT_FILENO);
+    for (int i = 0; i < 3; i++)
+    {
+        int fd = redirectionOrder[i];
+        if (plan->source[fd] != -1 && plan->source[fd] != fd && dup2(plan->source[fd], fd) == -1)
+        {
+            perror("invalid: dup2 failed");
+            _exit(EXIT_FAILURE);
+        }
+    }
 }
 
-int redirectionsSTDINtoFile(const char *token)
+/* Closes the files opened by planRedirections */
+void closeRedirections(struct redirectionPlan *plan)
 {
-    return redirectionToFile(token, STDIN_FILENO);
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+    {
+        if (plan->opened[fd] != -1)
+        {
+            close(plan->opened[fd]);
+            plan->opened[fd] = -1;
+        }
+    }
 }
 
-/* Redirect to files*/
-int redirectionToFile(const char *token, int fileDescriptor)
+/* Opens the file a redirection of fileDescriptor names, close-on-exec so that
+ * it only reaches a child through dup2. Output files are truncated, or with
+ * append (>> and 2>>) opened O_APPEND so that every write lands at the end
+ * even when several jobs log to the same file. Returns -1 after reporting the
+ * error */
+int openRedirectionFile(const char *token, int fileDescriptor, int append)
 {
 
     if (token == NULL || token[0] == '\0')
     {
         perror("Invalid standard input redirect: Empty file name");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     // open the file
     int file;
     if (fileDescriptor == STDIN_FILENO)
     {
-        file = open(token, O_RDONLY);
+        file = open(token, O_RDONLY | O_CLOEXEC);
     }
-    else if (fileDescriptor == STDOUT_FILENO)
+    else if (fileDescriptor == STDOUT_FILENO || fileDescriptor == STDERR_FILENO)
     {
-        file = open(token, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file = open(token, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) | O_CLOEXEC, 0644);
     }
     else
     {
         perror("Invalid standard redirect: File descriptor not recognized");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     if (file == -1)
     {
@@ -564,18 +1821,15 @@ int redirectionToFile(const char *token, int fileDescriptor)
         {
             perror("Invalid standard output redirect: No such file or directory");
         }
+        else if (fileDescriptor == STDERR_FILENO)
+        {
+            perror("Invalid standard error redirect: No such file or directory");
+        }
         else
         {
             perror("Invalid standard redirect: File descriptor not recognized");
         }
-
-        exit(EXIT_FAILURE);
-    }
-    // redirect the standard output to the file
-    if (dup2(file, fileDescriptor) == -1)
-    {
-        perror("invalid: dup2 failed");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     return file;
 }
@@ -591,91 +1845,178 @@ void writeToStdout(char *text)
     }
 }
 
-/* Reads input from standard input till it reaches a new line character.
- * Checks if EOF (Ctrl + D) is being read and exits penn-shredder if that is the case
- * Otherwise, it checks for a valid input and adds the characters to an input buffer.
+/* Reads a line from standard input (or the script) through the buffered input
+ * reader. Returns NULL if EOF (Ctrl + D) is being read, so that penn-shredder
+ * exits. Otherwise, the line (without its new line character) is parsed into
+ * the stages of a pipeline.
  *
- * From this input buffer, the first 1023 characters (if more than 1023) or the whole
- * buffer are assigned to command and returned. An \0 is appended to the command so
- * that it is null terminated */
-char **getCommandFromInput()
+ * The reader pulls its input in large chunks and keeps whatever follows
+ * the new line for the next call, so a script costs one read() per chunk
+ * instead of one per character. Before a command runs, the read-ahead of a
+ * seekable standard input is given back, so the command reads the lines
+ * after its own as it would in sh; a piped one is read a byte at a time. */
+PIPELINE *getCommandFromInput()
 {
-    // declare a buffer to store the input
-    char buffer[INPUT_SIZE];
-    int i = 0;
-
-    // read input from stdin
-    while (i < INPUT_SIZE)
+    // at the prompt this includes the time the user takes to type
+    struct timespec start;
+    phaseStart(&start);
+    // read the next line from stdin or the script
+    char *buffer = read_line(inputReader);
+    if (buffer == NULL && inputReader->error == E2BIG)
+    {
+        // the rest of the line was skipped; none of it runs, and it counts
+        // as a failed command like a line that does not parse
+        fprintf(stderr, "invalid: command line longer than %ld bytes\n", (long)inputReader->max - 1);
+        commandsRun++;
+        commandsFailed++;
+        buffer = "";
+    }
+    else if (buffer == NULL)
     {
-        // read one character at a time
-        ssize_t bytesRead = read(STDIN_FILENO, &buffer[i], sizeof(char));
         // check for errors
-        if (bytesRead == -1)
+        if (inputReader->error != 0)
         {
+            errno = inputReader->error;
             perror("invalid: read character failed");
             exit(EXIT_FAILURE);
         }
-        // check for EOF
-        else if (bytesRead == 0)
-        {
-            exit(EXIT_SUCCESS);
-        }
-        // check for new line
-        else if (buffer[i] == '\n')
-        {
-            break;
-        }
-        // update index
-        else
+        // EOF
+        return NULL;
+    }
+
+    // trim the spaces
+    // command = trimSpaces(command);
+
+    if (commandHistory != NULL)
+    {
+        buffer = expandHistory(buffer);
+        if (buffer == NULL)
         {
-            i++;
+            // an event that is not in the history runs nothing
+            buffer = "";
         }
     }
 
-    // add null terminator to the end of the buffer
-    buffer[i] = '\0';
+    phaseEnd(PHASE_READ, &start);
 
-    // allocate memory for command
-    char *command = (char *)malloc(sizeof(char) * (strlen(buffer) + 1));
-
-    // check whether malloc was successful
-    if (command == NULL)
+    phaseStart(&start);
+    // the parser copies the tokens out of the reader's buffer, into the
+    // arena or, for a script, into the cache where the next run of the same
+    // line finds them already parsed
+    PIPELINE *pipeline = parsedLines != NULL ? parse_cache_lookup(parsedLines, buffer)
+                                             : parse_command(commandArena, buffer);
+    if (pipeline == NULL)
     {
         perror("invalid: malloc failed");
         exit(EXIT_FAILURE);
     }
+    phaseEnd(PHASE_PARSE, &start);
+    return pipeline;
+}
 
-    // copy buffer to command
-    strcpy(command, buffer);
-
-    // trim the spaces
-    // command = trimSpaces(command);
-
-    char **commandArray;
-    int commandArraySize = 1024;
-    int commandArrayPtr = 0;
-    TOKENIZER *tokenizer;
-    char *tok;
-
-    // allocate memory for command array
-    commandArray = (char **)malloc(sizeof(char **) * commandArraySize);
-
-    if (commandArray == NULL)
+/* Creates the history and loads the lines saved by earlier sessions from
+ * $HOME/.penn-shredder_history, which every new line is then appended to.
+ * Without the file the history only lasts for this session */
+void initHistory()
+{
+    commandHistory = init_history(HISTORY_ENTRIES, HISTORY_SIZE);
+    if (commandHistory == NULL)
+    {
+        perror("invalid: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    const char *home = getenv("HOME");
+    if (home == NULL)
+    {
+        return;
+    }
+    char *path = malloc(strlen(home) + strlen(HISTORY_FILE) + 2);
+    if (path == NULL)
     {
         perror("invalid: malloc failed");
         exit(EXIT_FAILURE);
     }
+    sprintf(path, "%s/%s", home, HISTORY_FILE);
+    if (history_load(commandHistory, path) == -1)
+    {
+        perror(path);
+    }
+    free(path);
+}
+
+/* Replaces a history event at the start of the line with the line it names,
+ * keeping the rest of the line: !! is the previous line, !n line n, !-n the
+ * n-th previous line and !text the newest line starting with text. The
+ * expanded line is echoed, as in sh, and every non-blank line is added to the
+ * history. Returns the line, in the arena if it was expanded, or NULL if the
+ * event is not in the history */
+char *expandHistory(char *line)
+{
+    if (line[0] == '!' && line[1] != '\0' && line[1] != ' ' && line[1] != '\t')
+    {
+        char *rest = line + 1;
+        long number;
+        if (*rest == '!')
+        {
+            number = history_last(commandHistory);
+            rest++;
+        }
+        else if (*rest == '-' || (*rest >= '0' && *rest <= '9'))
+        {
+            number = strtol(rest, &rest, 10);
+            if (number <= 0)
+            {
+                number += history_last(commandHistory) + 1;
+            }
+        }
+        else
+        {
+            rest += strcspn(rest, " \t|&<>");
+            char saved = *rest;
+            *rest = '\0';
+            number = history_find_prefix(commandHistory, line + 1);
+            *rest = saved;
+        }
+
+        const char *event = history_get(commandHistory, number);
+        if (event == NULL)
+        {
+            fprintf(stderr, "%.*s: event not found\n", (int)(rest - line), line);
+            return NULL;
+        }
+        char *expanded = allocateFromArena(strlen(event) + strlen(rest) + 1);
+        strcpy(expanded, event);
+        strcat(expanded, rest);
+        printf("%s\n", expanded);
+        fflush(stdout);
+        line = expanded;
+    }
+    if (line[strspn(line, " \t")] != '\0')
+    {
+        history_add(commandHistory, line);
+    }
+    return line;
+}
 
-    tokenizer = init_tokenizer(command);
-    while ((tok = get_next_token(tokenizer)) != NULL)
+/* history [n]: lists the history, or its last n lines */
+int builtinHistory(char **argv)
+{
+    if (commandHistory == NULL)
     {
-        // commandArray = (char*) malloc(sizeof(char*) * strlen(tok) + 1);
-        commandArray[commandArrayPtr++] = tok;
+        return 0;
     }
-    commandArray[commandArrayPtr] = NULL;
-    free(command);
-    free_tokenizer(tokenizer);
-    return commandArray;
+    long last = history_last(commandHistory);
+    long number = argv[1] != NULL ? last - atol(argv[1]) + 1 : 1;
+    if (number < commandHistory->first)
+    {
+        number = commandHistory->first;
+    }
+    for (; number <= last; number++)
+    {
+        printf("%5ld  %s\n", number, history_get(commandHistory, number));
+    }
+    fflush(stdout);
+    return 0;
 }
 
 /*
@@ -706,17 +2047,28 @@ char *trimSpaces(char *str)
     return str;
 }
 
-int isPipe(char **commandArray)
+/* Returns the number of tokens before the NULL terminator */
+int countTokens(char **commandArray)
 {
-    // traverse the command array and compare each character with pipe mark
-    for (int i = 0; commandArray[i] != NULL; i++)
+    int count = 0;
+    while (commandArray[count] != NULL)
     {
-        if (strcmp(commandArray[i], "|") == 0)
-        {
-            return 1;
-        }
+        count++;
     }
-    return 0;
+    return count;
+}
+
+/* Allocates from the per-command arena and exits the shell if the arena
+ * cannot grow. The memory lives until executeShell() resets the arena */
+void *allocateFromArena(size_t size)
+{
+    void *mem = arena_alloc(commandArena, size);
+    if (mem == NULL)
+    {
+        perror("invalid: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    return mem;
 }
 
 int output(char *str)
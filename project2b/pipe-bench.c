@@ -0,0 +1,178 @@
+#define _GNU_SOURCE		/* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "pipecopy.h"
+
+
+/* default size of the file pushed through the pipe */
+#define BENCH_MEGABYTES 256
+
+/* buffer of the read/write copy, the size coreutils cat uses */
+#define COPY_BUFFER (128 * 1024)
+
+/* buffer of the consumer, e.g. grep or md5sum reading its input */
+#define CONSUMER_BUFFER (64 * 1024)
+
+
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+static double now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/**
+ * Writes a file of the given size and reads it back once, so that every
+ * run copies from the page cache.
+ *
+ * @return a descriptor of the file, which is already unlinked
+ */
+static int make_input( size_t bytes )
+{
+  char name[] = "/tmp/pipe-bench-XXXXXX";
+  char *buf = (char *)malloc( COPY_BUFFER );
+  size_t done;
+  int fd;
+  size_t i;
+
+  fd = mkstemp( name );
+  if( fd == -1 || buf == NULL ) {
+    perror( "pipe-bench: input file" );
+    exit( 1 );
+  }
+  unlink( name );
+  for( i = 0; i < COPY_BUFFER; i++ )
+    buf[i] = "penn-shredder\n"[i % 14];
+  for( done = 0; done < bytes; done += COPY_BUFFER ) {
+    if( write(fd, buf, COPY_BUFFER) != COPY_BUFFER ) {
+      perror( "pipe-bench: input file" );
+      exit( 1 );
+    }
+  }
+  lseek( fd, 0, SEEK_SET );
+  while( read(fd, buf, COPY_BUFFER) > 0 )
+    ;
+  free( buf );
+  return fd;
+}
+
+
+
+/**
+ * Copies in to out through a user space buffer, as cat does.
+ */
+static void read_write_copy( int in, int out )
+{
+  char *buf = (char *)malloc( COPY_BUFFER );
+  ssize_t n;
+  ssize_t w;
+  ssize_t off;
+
+  while( (n = read(in, buf, COPY_BUFFER)) > 0 ) {
+    for( off = 0; off < n; off += w ) {
+      w = write( out, buf + off, n - off );
+      if( w == -1 ) {
+	perror( "pipe-bench: write" );
+	exit( 1 );
+      }
+    }
+  }
+  free( buf );
+}
+
+
+
+/**
+ * Moves the whole input file through a pipe into a consumer process that
+ * reads and discards it, and prints the throughput.
+ *
+ * @param in the input file
+ * @param bytes its size
+ * @param pipe_size capacity to set on the pipe, 0 for the default
+ * @param use_splice copy with pipe_copy() instead of read()/write()
+ */
+static void bench( int in, size_t bytes, int pipe_size, int use_splice )
+{
+  char buf[CONSUMER_BUFFER];
+  int capacity;
+  int fd[2];
+  pid_t pid;
+  double start;
+  double elapsed;
+
+  lseek( in, 0, SEEK_SET );
+  if( pipe2(fd, O_CLOEXEC) == -1 ) {
+    perror( "pipe-bench: pipe" );
+    exit( 1 );
+  }
+  if( pipe_size != 0 && pipe_resize(fd[1], pipe_size) == -1 )
+    perror( "pipe-bench: F_SETPIPE_SZ" );
+  capacity = fcntl( fd[1], F_GETPIPE_SZ );
+
+  start = now();
+  pid = fork();
+  if( pid == 0 ) {
+    close( fd[1] );
+    while( read(fd[0], buf, sizeof(buf)) > 0 )
+      ;
+    _exit( 0 );
+  }
+  close( fd[0] );
+  if( use_splice )
+    pipe_copy( in, fd[1] );
+  else
+    read_write_copy( in, fd[1] );
+  close( fd[1] );
+  waitpid( pid, NULL, 0 );
+  elapsed = now() - start;
+
+  printf( "%-12s %10d %10.0f\n", use_splice ? "splice" : "read/write", capacity,
+	  bytes / elapsed / 1e6 );
+}
+
+
+
+/**
+ * Usage: pipe-bench [megabytes]
+ * Compares a read/write copy with a spliced one, each with the default
+ * pipe capacity and with the largest one an unprivileged process may set.
+ */
+int main( int argc, char *argv[] )
+{
+  size_t bytes = (size_t)(argc > 1 ? atoi(argv[1]) : BENCH_MEGABYTES) * 1024 * 1024;
+  int max_size = 1024 * 1024;
+  FILE *limit;
+  int in;
+  int round;
+
+  limit = fopen( "/proc/sys/fs/pipe-max-size", "r" );
+  if( limit != NULL ) {
+    if( fscanf(limit, "%d", &max_size) != 1 )
+      max_size = 1024 * 1024;
+    fclose( limit );
+  }
+
+  in = make_input( bytes );
+  printf( "%-12s %10s %10s\n", "copy", "pipe size", "MB/s" );
+  /* the second round shows how much of the first was warm-up */
+  for( round = 0; round < 2; round++ ) {
+    bench( in, bytes, 0, 0 );
+    bench( in, bytes, max_size, 0 );
+    bench( in, bytes, 0, 1 );
+    bench( in, bytes, max_size, 1 );
+  }
+  close( in );
+  return 0;
+}
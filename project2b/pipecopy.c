@@ -0,0 +1,118 @@
+#define _GNU_SOURCE		/* splice() and F_SETPIPE_SZ */
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pipecopy.h"
+
+
+
+
+/**
+ * Tells whether fd refers to a pipe or FIFO.
+ */
+static int is_pipe( int fd )
+{
+  struct stat st;
+
+  return fstat( fd, &st ) == 0 && S_ISFIFO(st.st_mode);
+}
+
+
+
+/**
+ * Writes all of buf, across short writes.
+ *
+ * @return 0 on success, -1 on error with errno set
+ */
+static int write_all( int fd, const char *buf, size_t len )
+{
+  ssize_t n;
+
+  while( len > 0 ) {
+    n = write( fd, buf, len );
+    if( n == -1 ) {
+      if( errno == EINTR )
+	continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+
+/**
+ * Sets the capacity of a pipe with F_SETPIPE_SZ.  The kernel rounds it
+ * up to a power of two pages; unprivileged processes are limited to
+ * /proc/sys/fs/pipe-max-size.
+ *
+ * @param fd either end of the pipe
+ * @param size the capacity wanted, in bytes
+ * @return the capacity the pipe has now, or -1 on error with errno set
+ */
+int pipe_resize( int fd, int size )
+{
+  return fcntl( fd, F_SETPIPE_SZ, size );
+}
+
+
+
+/**
+ * Copies everything from in to out until end of file.  If either side
+ * is a pipe the data is moved with splice(), inside the kernel, without
+ * passing through a user space buffer.  Otherwise, or if the file system
+ * does not support splicing, it falls back to read() and write().
+ *
+ * @param in the descriptor to read from
+ * @param out the descriptor to write to
+ * @return the number of bytes copied, or -1 on error with errno set
+ */
+ssize_t pipe_copy( int in, int out )
+{
+  ssize_t total = 0;
+  ssize_t n;
+  char *buf;
+
+  if( is_pipe(in) || is_pipe(out) ) {
+    for( ;; ) {
+      n = splice( in, NULL, out, NULL, PIPE_COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE );
+      if( n == 0 )
+	return total;
+      if( n == -1 ) {
+	if( errno == EINTR )
+	  continue;
+	/* EINVAL: one side cannot splice; nothing was moved yet by this call */
+	if( errno == EINVAL )
+	  break;
+	return -1;
+      }
+      total += n;
+    }
+  }
+
+  buf = (char *)malloc( PIPE_COPY_CHUNK );
+  if( buf == NULL )
+    return -1;
+  for( ;; ) {
+    n = read( in, buf, PIPE_COPY_CHUNK );
+    if( n == 0 )
+      break;
+    if( n == -1 ) {
+      if( errno == EINTR )
+	continue;
+      total = -1;
+      break;
+    }
+    if( write_all(out, buf, n) == -1 ) {
+      total = -1;
+      break;
+    }
+    total += n;
+  }
+  free( buf );
+  return total;
+}
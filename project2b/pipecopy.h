@@ -0,0 +1,40 @@
+#ifndef __PIPECOPY_H__
+#define __PIPECOPY_H__
+
+
+#include <sys/types.h>
+
+
+
+/* bytes moved per splice() or read() call */
+#define PIPE_COPY_CHUNK (1024 * 1024)
+
+
+
+/**
+ * Sets the capacity of a pipe with F_SETPIPE_SZ.  The kernel rounds it
+ * up to a power of two pages; unprivileged processes are limited to
+ * /proc/sys/fs/pipe-max-size.
+ *
+ * @param fd either end of the pipe
+ * @param size the capacity wanted, in bytes
+ * @return the capacity the pipe has now, or -1 on error with errno set
+ */
+int pipe_resize( int fd, int size );
+
+
+
+/**
+ * Copies everything from in to out until end of file.  If either side
+ * is a pipe the data is moved with splice(), inside the kernel, without
+ * passing through a user space buffer.  Otherwise, or if the file system
+ * does not support splicing, it falls back to read() and write().
+ *
+ * @param in the descriptor to read from
+ * @param out the descriptor to write to
+ * @return the number of bytes copied, or -1 on error with errno set
+ */
+ssize_t pipe_copy( int in, int out );
+
+
+#endif
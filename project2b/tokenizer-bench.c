@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "tokenizer.h"
+
+
+/* every benchmark run lasts at least this long */
+#define BENCH_MIN_SECONDS 0.25
+
+/* longest input the fuzzer generates */
+#define FUZZ_MAX_LEN 300
+
+
+
+/*
+ * malloc() calls made while a benchmark runs.  The bench target links
+ * with -Wl,--wrap=malloc so that every malloc in this program and in
+ * tokenizer.c goes through __wrap_malloc().
+ */
+static unsigned long malloc_calls = 0;
+
+void *__real_malloc( size_t size );
+
+void *__wrap_malloc( size_t size )
+{
+  malloc_calls++;
+  return __real_malloc( size );
+}
+
+
+
+/**
+ * A set of input lines to tokenize.
+ */
+typedef struct corpus {
+  const char *name;
+  char **lines;
+  int count;
+  size_t bytes;			/* total length of all lines */
+} CORPUS;
+
+
+
+static const char *scan_names[] = { "auto", "scalar", "sse2", "avx2" };
+
+
+
+/**
+ * The tokenizer as originally shipped, plus the >>, 2>, 2>> and 2>&1
+ * operators, kept as the reference the optimized scanners are checked
+ * against.  Returns a malloc'd token and advances *pos, or returns NULL
+ * at the end of the string.
+ */
+static char *reference_next_token( char **pos )
+{
+  char *startptr = *pos;
+  char *endptr;
+  char *tok;
+  size_t len;
+
+  if( **pos == '\0' )
+    return NULL;
+
+  if( (*startptr == '|') || (*startptr == '&') ||
+      (*startptr == '<') || (*startptr == '>') ) {
+    len = (*startptr == '>' && *(startptr+1) == '>') ? 2 : 1;
+    tok = (char *)malloc(len + 1);
+    memcpy( tok, startptr, len );
+    tok[len] = '\0';
+    *pos += len;
+    return tok;
+  }
+
+  while( isspace(*startptr) )
+    startptr++;
+
+  if( *startptr == '\0' )
+    return NULL;
+
+  if( strncmp(startptr, "2>", 2) == 0 ) {
+    if( *(startptr+2) == '>' )
+      len = 3;
+    else if( strncmp(startptr + 2, "&1", 2) == 0 &&
+	     ((*(startptr+4) == '|') || (*(startptr+4) == '&') || (*(startptr+4) == '<') ||
+	      (*(startptr+4) == '>') || (*(startptr+4) == '\0') || isspace(*(startptr+4))) )
+      len = 4;
+    else
+      len = 2;
+    tok = (char *)malloc(len + 1);
+    memcpy( tok, startptr, len );
+    tok[len] = '\0';
+    *pos = startptr + len;
+    return tok;
+  }
+
+  endptr = startptr;
+  for( ;; ) {
+    if( (*(endptr+1) == '|') || (*(endptr+1) == '&') || (*(endptr+1) == '<') ||
+	(*(endptr+1) == '>') || (*(endptr+1) == '\0') || (isspace(*(endptr+1))) ) {
+      tok = (char *)malloc( (endptr - startptr) + 2 );
+      memcpy( tok, startptr, (endptr - startptr) + 1 );
+      tok[(endptr - startptr) + 1] = '\0';
+      *pos = endptr + 1;
+      while( isspace(**pos) )
+	(*pos)++;
+      return tok;
+    }
+    endptr++;
+  }
+}
+
+
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+static double now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+/**
+ * Appends n words picked from words[] to line, separated by sep.
+ */
+static size_t append_words( char *line, size_t len, int n, const char **words,
+			    int nwords, const char *sep )
+{
+  int i;
+
+  for( i = 0; i < n; i++ ) {
+    if( i > 0 )
+      len += sprintf( line + len, "%s", sep );
+    len += sprintf( line + len, "%s", words[rand() % nwords] );
+  }
+  return len;
+}
+
+
+
+/**
+ * Builds count lines of one of the benchmark corpora.
+ */
+static void build_corpus( CORPUS *corpus, const char *name, int count )
+{
+  static const char *commands[] = { "ls", "grep", "cat", "wc", "sort", "echo",
+				     "xargs", "head", "/usr/bin/env", "awk" };
+  static const char *args[] = { "-l", "-n", "foo", "bar.txt", "/tmp/out.log",
+				"--color=auto", "-rf", "some_longer_argument",
+				"src/penn-shredder.c", "42" };
+  static const char *delims[] = { "|", "&", "<", ">" };
+  size_t size = 16384;
+  size_t len;
+  char *line;
+  int i;
+  int j;
+
+  corpus->name = name;
+  corpus->lines = (char **)malloc( sizeof(char *) * count );
+  corpus->count = count;
+  corpus->bytes = 0;
+  for( i = 0; i < count; i++ ) {
+    line = (char *)malloc( size );
+    len = 0;
+    if( strcmp(name, "short") == 0 ) {
+      /* ls -l foo | grep bar.txt > /tmp/out.log */
+      len = append_words( line, len, 1, commands, 10, "" );
+      len += sprintf( line + len, " " );
+      len = append_words( line, len, 1 + rand() % 3, args, 10, " " );
+      if( rand() % 2 ) {
+	len += sprintf( line + len, " | " );
+	len = append_words( line, len, 1, commands, 10, "" );
+	len += sprintf( line + len, " " );
+	len = append_words( line, len, 1, args, 10, "" );
+      }
+    }
+    else if( strcmp(name, "long") == 0 ) {
+      /* xargs-style argument list of about 4 KiB */
+      len = append_words( line, len, 1, commands, 10, "" );
+      len += sprintf( line + len, " " );
+      len = append_words( line, len, 300, args, 10, " " );
+    }
+    else if( strcmp(name, "delimiter") == 0 ) {
+      /* a|b&c<d>e with no spaces */
+      for( j = 0; j < 60; j++ ) {
+	len = append_words( line, len, 1, args, 10, "" );
+	len = append_words( line, len, 1, delims, 4, "" );
+      }
+      len = append_words( line, len, 1, args, 10, "" );
+    }
+    else {
+      /* words separated by long runs of blanks and tabs */
+      for( j = 0; j < 20; j++ ) {
+	len += sprintf( line + len, "%*s\t%*s", rand() % 40, "", rand() % 40, "" );
+	len = append_words( line, len, 1, args, 10, "" );
+      }
+      len += sprintf( line + len, "%*s", rand() % 40, "" );
+    }
+    corpus->lines[i] = line;
+    corpus->bytes += len;
+  }
+}
+
+
+
+/**
+ * Tokenizes the whole corpus with the chosen API until BENCH_MIN_SECONDS
+ * pass and prints throughput and allocations per line.
+ */
+static void bench( CORPUS *corpus, const char *api, TOKENIZER_SCAN scan )
+{
+  TOKENIZER *tokenizer;
+  TOKENIZER view_tokenizer;
+  TOKEN_VIEW view;
+  unsigned long tokens = 0;
+  unsigned long allocs;
+  unsigned long rounds = 0;
+  double start;
+  double elapsed;
+  char *tok;
+  char *pos;
+  int i;
+
+  allocs = malloc_calls;
+  start = now();
+  do {
+    for( i = 0; i < corpus->count; i++ ) {
+      if( strcmp(api, "reference") == 0 ) {
+	pos = corpus->lines[i];
+	while( (tok = reference_next_token( &pos )) != NULL ) {
+	  tokens++;
+	  free( tok );
+	}
+      }
+      else if( strcmp(api, "malloc") == 0 ) {
+	tokenizer = init_tokenizer( corpus->lines[i] );
+	while( (tok = get_next_token( tokenizer )) != NULL ) {
+	  tokens++;
+	  free( tok );
+	}
+	free_tokenizer( tokenizer );
+      }
+      else {
+	init_tokenizer_view( &view_tokenizer, corpus->lines[i] );
+	while( get_next_token_view( &view_tokenizer, &view ) )
+	  tokens++;
+      }
+    }
+    rounds++;
+    elapsed = now() - start;
+  } while( elapsed < BENCH_MIN_SECONDS );
+  allocs = malloc_calls - allocs;
+
+  printf( "%-10s %-10s %-7s %12.0f %10.1f %12.2f\n", corpus->name, api,
+	  strcmp(api, "reference") == 0 ? "-" : scan_names[scan],
+	  tokens / elapsed, corpus->bytes * rounds / elapsed / 1e6,
+	  (double)allocs / (rounds * corpus->count) );
+}
+
+
+
+/**
+ * Runs every API and scanner over every corpus.
+ */
+static int run_bench( void )
+{
+  static const char *names[] = { "short", "long", "delimiter", "whitespace" };
+  static const int counts[] = { 20000, 200, 1000, 1000 };
+  TOKENIZER_SCAN scan;
+  CORPUS corpus;
+  int i;
+  int j;
+
+  srand( 1 );
+  printf( "%-10s %-10s %-7s %12s %10s %12s\n", "corpus", "api", "scan",
+	  "tokens/s", "MB/s", "allocs/line" );
+  for( i = 0; i < 4; i++ ) {
+    build_corpus( &corpus, names[i], counts[i] );
+    bench( &corpus, "reference", TOKENIZER_SCAN_SCALAR );
+    for( scan = TOKENIZER_SCAN_SCALAR; scan <= TOKENIZER_SCAN_AVX2; scan++ ) {
+      if( tokenizer_set_scan( scan ) == -1 )
+	continue;
+      bench( &corpus, "malloc", scan );
+      bench( &corpus, "view", scan );
+    }
+    for( j = 0; j < corpus.count; j++ )
+      free( corpus.lines[j] );
+    free( corpus.lines );
+  }
+  return 0;
+}
+
+
+
+/**
+ * Prints a fuzz input with control characters escaped.
+ */
+static void print_input( const char *s )
+{
+  printf( "input: \"" );
+  for( ; *s != '\0'; s++ ) {
+    if( isprint((unsigned char)*s) && *s != '"' && *s != '\\' )
+      putchar( *s );
+    else
+      printf( "\\x%02x", (unsigned char)*s );
+  }
+  printf( "\"\n" );
+}
+
+
+
+/**
+ * Tokenizes s with the reference and with both public APIs and reports
+ * the first token that differs.
+ *
+ * @return 0 if all three agree, 1 otherwise
+ */
+static int compare( char *s, TOKENIZER_SCAN scan )
+{
+  TOKENIZER *tokenizer = init_tokenizer( s );
+  TOKENIZER view_tokenizer;
+  TOKEN_VIEW view;
+  char *pos = s;
+  char *expected;
+  char *tok;
+  int have_view;
+  int index = 0;
+  int status = 0;
+
+  init_tokenizer_view( &view_tokenizer, s );
+  do {
+    expected = reference_next_token( &pos );
+    tok = get_next_token( tokenizer );
+    have_view = get_next_token_view( &view_tokenizer, &view );
+    if( (expected == NULL) != (tok == NULL) ||
+	(expected == NULL) != !have_view ||
+	(expected != NULL && (strcmp(expected, tok) != 0 ||
+			      strlen(expected) != view.len ||
+			      memcmp(expected, view.start, view.len) != 0)) ) {
+      printf( "MISMATCH (scan %s) at token %d\n", scan_names[scan], index );
+      print_input( s );
+      printf( "reference: %s\nmalloc:    %s\nview:      %.*s\n",
+	      expected ? expected : "(end)", tok ? tok : "(end)",
+	      have_view ? (int)view.len : 5, have_view ? view.start : "(end)" );
+      status = 1;
+    }
+    free( expected );
+    free( tok );
+    index++;
+  } while( status == 0 && expected != NULL );
+  free_tokenizer( tokenizer );
+  return status;
+}
+
+
+
+/**
+ * Differential fuzzing: random lines built from delimiters, every kind
+ * of whitespace, high bytes and word characters, placed at random
+ * alignments, must tokenize identically in every scanner.
+ */
+static int run_fuzz( long iterations, unsigned int seed )
+{
+  static const char alphabet[] = " \t\n\v\f\r|&<>12abc-/.\x80\xff";
+  char buf[FUZZ_MAX_LEN + 64];
+  TOKENIZER_SCAN scan;
+  char *s;
+  long i;
+  int len;
+  int j;
+
+  srand( seed );
+  for( i = 0; i < iterations; i++ ) {
+    s = buf + rand() % 64;
+    len = rand() % FUZZ_MAX_LEN;
+    for( j = 0; j < len; j++ )
+      s[j] = rand() % 3 ? alphabet[rand() % (sizeof(alphabet) - 1)] : 'x';
+    s[len] = '\0';
+    for( scan = TOKENIZER_SCAN_SCALAR; scan <= TOKENIZER_SCAN_AVX2; scan++ ) {
+      if( tokenizer_set_scan( scan ) == -1 )
+	continue;
+      if( compare( s, scan ) != 0 )
+	return 1;
+    }
+  }
+  printf( "fuzz: %ld inputs matched the reference (seed %u)\n", iterations, seed );
+  return 0;
+}
+
+
+
+/**
+ * Usage: tokenizer-bench              benchmark every corpus
+ *        tokenizer-bench fuzz [n] [seed]   differential fuzzing
+ */
+int main( int argc, char *argv[] )
+{
+  if( argc > 1 && strcmp(argv[1], "fuzz") == 0 )
+    return run_fuzz( argc > 2 ? atol(argv[2]) : 200000,
+		     argc > 3 ? (unsigned int)atoi(argv[3]) : 1 );
+  if( argc > 1 ) {
+    fprintf( stderr, "usage: %s [fuzz [iterations] [seed]]\n", argv[0] );
+    return 1;
+  }
+  return run_bench();
+}
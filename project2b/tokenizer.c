@@ -3,8 +3,286 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stdint.h>
 #include "tokenizer.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TOKENIZER_HAVE_SIMD 1
+#endif
+
+
+/*
+ * Character classes used by the scanners.  SPACE is what isspace()
+ * accepts in the C locale the shell runs in; BREAK is every character
+ * that ends a word: whitespace, the delimiters |&<> and the final \0.
+ */
+#define CLASS_SPACE 1
+#define CLASS_BREAK 2
+
+/*
+ * Most words and gaps are short, so the vector scanners look at this
+ * many characters through the table before loading a vector.  Starting
+ * with an unaligned vector load instead measured slower.  As a result
+ * the vectors only pay off for long words and long runs of blanks
+ * (about 1.7x on the whitespace corpus of tokenizer-bench); lines of
+ * short words tokenize at the scalar speed, as the work per token
+ * outweighs the scan.
+ */
+#define SCAN_HEAD 8
+
+static unsigned char char_class[256];
+
+/* the scanners picked by tokenizer_set_scan() */
+static const char *(*skip_space)( const char *p );
+static const char *(*find_break)( const char *p );
+
+
+
+
+/**
+ * Fills char_class from isspace() and the delimiter list.
+ */
+static void init_char_class( void )
+{
+  int c;
+
+  for( c = 0; c < 256; c++ ) {
+    if( isspace(c) )
+      char_class[c] = CLASS_SPACE | CLASS_BREAK;
+  }
+  char_class['|'] = char_class['&'] = CLASS_BREAK;
+  char_class['<'] = char_class['>'] = CLASS_BREAK;
+  char_class['\0'] = CLASS_BREAK;
+}
+
+
+
+/**
+ * Scalar scanners: one table lookup per character.
+ */
+static const char *skip_space_scalar( const char *p )
+{
+  while( char_class[(unsigned char)*p] & CLASS_SPACE )
+    p++;
+  return p;
+}
+
+static const char *find_break_scalar( const char *p )
+{
+  while( !(char_class[(unsigned char)*p] & CLASS_BREAK) )
+    p++;
+  return p;
+}
+
+
+
+#ifdef TOKENIZER_HAVE_SIMD
+/*
+ * Vector scanners.  They load whole aligned blocks, which may extend
+ * past the terminating \0 but never across a page boundary, so the
+ * extra bytes are always readable.  Bits for bytes before p in the
+ * first block are masked off.  Every scan stops at the \0, which is
+ * neither SPACE nor outside BREAK.
+ */
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#elif defined(__SANITIZE_ADDRESS__)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#ifndef NO_ASAN
+#define NO_ASAN
+#endif
+
+static inline unsigned space_bits_sse2( __m128i v )
+{
+  __m128i sp = _mm_cmpeq_epi8( v, _mm_set1_epi8(' ') );
+  /* '\t'..'\r' is the range 9..13: (c - 9) <= 4 as unsigned bytes */
+  __m128i x = _mm_sub_epi8( v, _mm_set1_epi8('\t') );
+  __m128i ctl = _mm_cmpeq_epi8( _mm_min_epu8(x, _mm_set1_epi8(4)), x );
+  return (unsigned)_mm_movemask_epi8( _mm_or_si128(sp, ctl) );
+}
+
+static inline unsigned break_bits_sse2( __m128i v )
+{
+  __m128i d = _mm_or_si128( _mm_cmpeq_epi8(v, _mm_set1_epi8('|')),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8('&')) );
+  d = _mm_or_si128( d, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')) );
+  d = _mm_or_si128( d, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')) );
+  d = _mm_or_si128( d, _mm_cmpeq_epi8(v, _mm_setzero_si128()) );
+  return (unsigned)_mm_movemask_epi8( d ) | space_bits_sse2( v );
+}
+
+NO_ASAN static const char *skip_space_sse2( const char *p )
+{
+  const __m128i *block;
+  unsigned bits;
+  int i;
+
+  for( i = 0; i < SCAN_HEAD; i++, p++ ) {
+    if( !(char_class[(unsigned char)*p] & CLASS_SPACE) )
+      return p;
+  }
+  block = (const __m128i *)((uintptr_t)p & ~(uintptr_t)15);
+  bits = ~space_bits_sse2( _mm_load_si128(block) ) & 0xffff;
+
+  bits &= 0xffffu << ((uintptr_t)p & 15);
+  while( bits == 0 )
+    bits = ~space_bits_sse2( _mm_load_si128(++block) ) & 0xffff;
+  return (const char *)block + __builtin_ctz( bits );
+}
+
+NO_ASAN static const char *find_break_sse2( const char *p )
+{
+  const __m128i *block;
+  unsigned bits;
+  int i;
+
+  for( i = 0; i < SCAN_HEAD; i++, p++ ) {
+    if( char_class[(unsigned char)*p] & CLASS_BREAK )
+      return p;
+  }
+  block = (const __m128i *)((uintptr_t)p & ~(uintptr_t)15);
+  bits = break_bits_sse2( _mm_load_si128(block) );
+
+  bits &= 0xffffu << ((uintptr_t)p & 15);
+  while( bits == 0 )
+    bits = break_bits_sse2( _mm_load_si128(++block) );
+  return (const char *)block + __builtin_ctz( bits );
+}
+
+__attribute__((target("avx2")))
+static inline unsigned space_bits_avx2( __m256i v )
+{
+  __m256i sp = _mm256_cmpeq_epi8( v, _mm256_set1_epi8(' ') );
+  __m256i x = _mm256_sub_epi8( v, _mm256_set1_epi8('\t') );
+  __m256i ctl = _mm256_cmpeq_epi8( _mm256_min_epu8(x, _mm256_set1_epi8(4)), x );
+  return (unsigned)_mm256_movemask_epi8( _mm256_or_si256(sp, ctl) );
+}
+
+__attribute__((target("avx2")))
+static inline unsigned break_bits_avx2( __m256i v )
+{
+  __m256i d = _mm256_or_si256( _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+			       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')) );
+  d = _mm256_or_si256( d, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')) );
+  d = _mm256_or_si256( d, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')) );
+  d = _mm256_or_si256( d, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()) );
+  return (unsigned)_mm256_movemask_epi8( d ) | space_bits_avx2( v );
+}
+
+__attribute__((target("avx2"))) NO_ASAN
+static const char *skip_space_avx2( const char *p )
+{
+  const __m256i *block;
+  unsigned bits;
+  int i;
+
+  for( i = 0; i < SCAN_HEAD; i++, p++ ) {
+    if( !(char_class[(unsigned char)*p] & CLASS_SPACE) )
+      return p;
+  }
+  block = (const __m256i *)((uintptr_t)p & ~(uintptr_t)31);
+  bits = ~space_bits_avx2( _mm256_load_si256(block) );
+
+  bits &= 0xffffffffu << ((uintptr_t)p & 31);
+  while( bits == 0 )
+    bits = ~space_bits_avx2( _mm256_load_si256(++block) );
+  return (const char *)block + __builtin_ctz( bits );
+}
+
+__attribute__((target("avx2"))) NO_ASAN
+static const char *find_break_avx2( const char *p )
+{
+  const __m256i *block;
+  unsigned bits;
+  int i;
+
+  for( i = 0; i < SCAN_HEAD; i++, p++ ) {
+    if( char_class[(unsigned char)*p] & CLASS_BREAK )
+      return p;
+  }
+  block = (const __m256i *)((uintptr_t)p & ~(uintptr_t)31);
+  bits = break_bits_avx2( _mm256_load_si256(block) );
+
+  bits &= 0xffffffffu << ((uintptr_t)p & 31);
+  while( bits == 0 )
+    bits = break_bits_avx2( _mm256_load_si256(++block) );
+  return (const char *)block + __builtin_ctz( bits );
+}
+#endif
+
+
+
+/**
+ * Selects the character scanning used by every tokenizer.  The widest
+ * one the CPU supports is selected automatically the first time a
+ * tokenizer is initialized; all of them return the same tokens.
+ *
+ * @param scan the implementation to use
+ * @return the implementation now in use, or -1 if the requested one is
+ *         not available on this machine (the previous one is kept)
+ */
+int tokenizer_set_scan( TOKENIZER_SCAN scan )
+{
+  if( char_class['\0'] == 0 )
+    init_char_class();
+
+#ifdef TOKENIZER_HAVE_SIMD
+  if( scan == TOKENIZER_SCAN_AUTO )
+    scan = __builtin_cpu_supports("avx2") ? TOKENIZER_SCAN_AVX2 : TOKENIZER_SCAN_SSE2;
+#else
+  if( scan == TOKENIZER_SCAN_AUTO )
+    scan = TOKENIZER_SCAN_SCALAR;
+#endif
+
+  switch( scan ) {
+  case TOKENIZER_SCAN_SCALAR:
+    skip_space = skip_space_scalar;
+    find_break = find_break_scalar;
+    break;
+#ifdef TOKENIZER_HAVE_SIMD
+  case TOKENIZER_SCAN_SSE2:
+    skip_space = skip_space_sse2;
+    find_break = find_break_sse2;
+    break;
+  case TOKENIZER_SCAN_AVX2:
+    if( !__builtin_cpu_supports("avx2") )
+      return -1;
+    skip_space = skip_space_avx2;
+    find_break = find_break_avx2;
+    break;
+#endif
+  default:
+    return -1;
+  }
+  return scan;
+}
+
+
+
+/**
+ * Length of the operator at p, or 0 if there is none.  The delimiters
+ * are one character long, except >> (append), and a word starting with
+ * 2> is the standard error redirection 2>, 2>> or 2>&1.
+ */
+static size_t operator_length( const char *p )
+{
+  if( p[0] == '2' && p[1] == '>' ) {
+    if( p[2] == '>' )
+      return 3;
+    if( p[2] == '&' && p[3] == '1' && (char_class[(unsigned char)p[4]] & CLASS_BREAK) )
+      return 4;
+    return 2;
+  }
+  if( p[0] == '>' )
+    return p[1] == '>' ? 2 : 1;
+  if( (p[0] == '|') || (p[0] == '&') || (p[0] == '<') )
+    return 1;
+  return 0;
+}
 
 
 
@@ -20,6 +298,8 @@ TOKENIZER *init_tokenizer( char *string )
   int len;
   assert( string != NULL );
 
+  if( skip_space == NULL )
+    tokenizer_set_scan( TOKENIZER_SCAN_AUTO );
   tokenizer = (TOKENIZER *)malloc(sizeof(TOKENIZER));
   assert( tokenizer != NULL );
   len = strlen(string) + 1;	/* don't forget \0 char */
@@ -46,59 +326,158 @@ void free_tokenizer( TOKENIZER *tokenizer )
 
 
 /**
- * Retrieves the next token in the string.  The returned token is
- * malloc'd in this function, so you should free it when done.
+ * Initializes a tokenizer whose state, string copy and tokens all come
+ * from an arena.  Nothing needs to be freed; resetting the arena
+ * releases the tokenizer and every token it returned.
+ *
+ * @param arena the arena to allocate from
+ * @param string the string that will be tokenized.  Should be non-NULL.
+ * @return an initialized string tokenizer on success, NULL on error.
+ */
+TOKENIZER *init_tokenizer_arena( ARENA *arena, char *string )
+{
+  TOKENIZER *tokenizer;
+  assert( string != NULL );
+
+  if( skip_space == NULL )
+    tokenizer_set_scan( TOKENIZER_SCAN_AUTO );
+  tokenizer = (TOKENIZER *)arena_alloc(arena, sizeof(TOKENIZER));
+  if( tokenizer == NULL )
+    return NULL;
+  tokenizer->str = arena_strndup( arena, string, strlen(string) );
+  if( tokenizer->str == NULL )
+    return NULL;
+  tokenizer->pos = tokenizer->str;
+  return tokenizer;
+}
+
+
+
+/**
+ * Copies len bytes starting at start into a new token, taken from the
+ * arena if there is one and malloc'd otherwise.
+ */
+static char *make_token( ARENA *arena, const char *start, size_t len )
+{
+  char *tok;
+
+  if( arena != NULL )
+    return arena_strndup( arena, start, len );
+  tok = (char *)malloc( len + 1 );
+  memcpy( tok, start, len );
+  tok[len] = '\0';		/* null-terminate the string */
+  return tok;
+}
+
+
+
+/**
+ * Initializes a tokenizer that works directly on the caller's string.
+ * Nothing is copied or allocated; the string must stay unchanged for
+ * as long as the tokenizer and the views it returns are used.
+ *
+ * @param tokenizer caller-owned tokenizer state, e.g. on the stack
+ * @param string the string that will be tokenized.  Should be non-NULL.
+ */
+void init_tokenizer_view( TOKENIZER *tokenizer, char *string )
+{
+  assert( tokenizer != NULL );
+  assert( string != NULL );
+
+  if( skip_space == NULL )
+    tokenizer_set_scan( TOKENIZER_SCAN_AUTO );
+  tokenizer->str = string;
+  tokenizer->pos = string;
+}
+
+
+
+/**
+ * Finds the next token in the string without copying it.  Tokens are
+ * words separated by whitespace and the operators | & < > >> 2> 2>> and
+ * 2>&1, which are tokens of their own.
  *
  * @param tokenizer an initiated string tokenizer
- * @return the next token
+ * @param view set to the position and length of the token inside the
+ *        tokenized string; the token is not null-terminated
+ * @return 1 if a token was found, 0 at the end of the string
  */
-char *get_next_token( TOKENIZER *tokenizer )
+int get_next_token_view( TOKENIZER *tokenizer, TOKEN_VIEW *view )
 {
   assert( tokenizer != NULL );
-  char *startptr = tokenizer->pos;
-  char *endptr;
-  char *tok;
+  assert( view != NULL );
+  const char *startptr = tokenizer->pos;
+  const char *endptr;
+  size_t len;
 
   if( *tokenizer->pos == '\0' )	/* handle end-case */
-    return NULL;
+    return 0;
 
-  
 
   /* if current position is a delimiter, then return it */
   if( (*startptr == '|') || (*startptr == '&') || 
       (*startptr == '<') || (*startptr == '>') ) {
-    tok = (char *)malloc(2);
-    tok[0] = *startptr;
-    tok[1] = '\0';
-    tokenizer->pos++;
-    return tok;
+    view->start = startptr;
+    view->len = operator_length( startptr );
+    tokenizer->pos += view->len;
+    return 1;
   }
 
-  while( isspace(*startptr) )	/* remove initial white spaces */
-    startptr++;
+  startptr = skip_space( startptr );	/* remove initial white spaces */
 
   if( *startptr == '\0' )
-    return NULL;
+    return 0;
 
-  /* go until next character is a delimiter */
-  endptr = startptr;
-  for( ;; ) {
-    if( (*(endptr+1) == '|') || (*(endptr+1) == '&') || (*(endptr+1) == '<') ||
-	(*(endptr+1) == '>') || (*(endptr+1) == '\0') || (isspace(*(endptr+1))) ) {
-      tok = (char *)malloc( (endptr - startptr) + 2 );
-      memcpy( tok, startptr, (endptr - startptr) + 1 );
-      tok[(endptr - startptr) + 1] = '\0'; /* null-terminate the string */
-      tokenizer->pos = endptr + 1;
-      while( isspace(*tokenizer->pos) ) /* remove trailing white space */
-	tokenizer->pos++;
-      return tok;
-    }
-    endptr++;
+  /* 2>, 2>> and 2>&1 are returned like a delimiter */
+  if( *startptr == '2' && (len = operator_length( startptr )) > 0 ) {
+    view->start = startptr;
+    view->len = len;
+    tokenizer->pos = (char *)startptr + len;
+    return 1;
   }
-  
-  assert( 0 );			/* should never reach here */
-  return NULL;			/* but satisfy compiler */
+
+  /* go until next character is a delimiter; the first character is
+   * part of the token even if it is one */
+  endptr = find_break( startptr + 1 );
+  view->start = startptr;
+  view->len = endptr - startptr;
+  /* remove trailing white space */
+  tokenizer->pos = (char *)skip_space( endptr );
+  return 1;
 }
 
 
 
+/**
+ * Retrieves the next token in the string.  The returned token is
+ * malloc'd in this function, so you should free it when done.
+ *
+ * @param tokenizer an initiated string tokenizer
+ * @return the next token
+ */
+char *get_next_token( TOKENIZER *tokenizer )
+{
+  TOKEN_VIEW view;
+
+  if( !get_next_token_view( tokenizer, &view ) )
+    return NULL;
+  return make_token( NULL, view.start, view.len );
+}
+
+
+
+/**
+ * Retrieves the next token in the string, allocated from the arena.
+ *
+ * @param arena the arena to allocate the token from
+ * @param tokenizer an initiated string tokenizer
+ * @return the next token
+ */
+char *get_next_token_arena( ARENA *arena, TOKENIZER *tokenizer )
+{
+  TOKEN_VIEW view;
+
+  if( !get_next_token_view( tokenizer, &view ) )
+    return NULL;
+  return make_token( arena, view.start, view.len );
+}
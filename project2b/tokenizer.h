@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 
 
 
@@ -19,6 +20,28 @@ typedef struct tokenizer {
 
 
 
+/**
+ * A token as a position and length inside the tokenized string.
+ */
+typedef struct token_view {
+  const char *start;		/* first character of the token */
+  size_t len;			/* number of characters in the token */
+} TOKEN_VIEW;
+
+
+
+/**
+ * Implementations of the character scanning inside the tokenizer.
+ */
+typedef enum tokenizer_scan {
+  TOKENIZER_SCAN_AUTO,		/* widest one the CPU supports */
+  TOKENIZER_SCAN_SCALAR,	/* one character at a time */
+  TOKENIZER_SCAN_SSE2,		/* 16 characters at a time (x86-64) */
+  TOKENIZER_SCAN_AVX2		/* 32 characters at a time (x86-64) */
+} TOKENIZER_SCAN;
+
+
+
 /**
  * Initializes the tokenizer
  *
@@ -47,4 +70,67 @@ void free_tokenizer( TOKENIZER *tokenizer );
 char *get_next_token( TOKENIZER *tokenizer );
 
 
+
+/**
+ * Initializes a tokenizer that works directly on the caller's string.
+ * Nothing is copied or allocated; the string must stay unchanged for
+ * as long as the tokenizer and the views it returns are used.
+ *
+ * @param tokenizer caller-owned tokenizer state, e.g. on the stack
+ * @param string the string that will be tokenized.  Should be non-NULL.
+ */
+void init_tokenizer_view( TOKENIZER *tokenizer, char *string );
+
+
+
+/**
+ * Finds the next token in the string without copying it.  Tokens are
+ * words separated by whitespace and the operators | & < > >> 2> 2>> and
+ * 2>&1, which are tokens of their own.
+ *
+ * @param tokenizer an initiated string tokenizer
+ * @param view set to the position and length of the token inside the
+ *        tokenized string; the token is not null-terminated
+ * @return 1 if a token was found, 0 at the end of the string
+ */
+int get_next_token_view( TOKENIZER *tokenizer, TOKEN_VIEW *view );
+
+
+
+/**
+ * Initializes a tokenizer whose state, string copy and tokens all come
+ * from an arena.  Nothing needs to be freed; resetting the arena
+ * releases the tokenizer and every token it returned.
+ *
+ * @param arena the arena to allocate from
+ * @param string the string that will be tokenized.  Should be non-NULL.
+ * @return an initialized string tokenizer on success, NULL on error.
+ */
+TOKENIZER *init_tokenizer_arena( ARENA *arena, char *string );
+
+
+
+/**
+ * Retrieves the next token in the string, allocated from the arena.
+ *
+ * @param arena the arena to allocate the token from
+ * @param tokenizer an initiated string tokenizer
+ * @return the next token
+ */
+char *get_next_token_arena( ARENA *arena, TOKENIZER *tokenizer );
+
+
+
+/**
+ * Selects the character scanning used by every tokenizer.  The widest
+ * one the CPU supports is selected automatically the first time a
+ * tokenizer is initialized; all of them return the same tokens.
+ *
+ * @param scan the implementation to use
+ * @return the implementation now in use, or -1 if the requested one is
+ *         not available on this machine (the previous one is kept)
+ */
+int tokenizer_set_scan( TOKENIZER_SCAN scan );
+
+
 #endif
@@ -2,7 +2,11 @@
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -10,18 +14,70 @@
 
 #define MAX_PENDING 10
 #define MAX_LINE 20
-#define MAX_THREADS 100
+// worker threads and queued connections, unless -w and -q say otherwise
+#define DEFAULT_WORKERS 16
+#define DEFAULT_QUEUE_DEPTH 1024
+// a worker needs little stack; the default would reserve megabytes of
+// address space for each of them
+#define WORKER_STACK_SIZE (64 * 1024)
+// a client that stays silent this long gives its worker back
+#define CLIENT_TIMEOUT_S 10
+
+// accepted sockets waiting for a worker, in a ring buffer of depth slots
+struct connection_queue
+{
+    int *sockets;
+    int depth;
+    // slot of the oldest socket, and how many are queued
+    int head;
+    int count;
+    // set while new connections are being turned away
+    int rejecting;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
 
 int send_message(int s, char *message, size_t size);
 int receive_message(int s, char *message, size_t size);
-void *connect_to_server(void *arg);
+void connect_to_server(int new_s);
 int bind_and_listen(struct sockaddr_in server_addr);
 struct sockaddr_in configure_server_address(int addr, int port);
+void init_queue(struct connection_queue *queue, int depth);
+int enqueue_client(struct connection_queue *queue, int new_s);
+int dequeue_client(struct connection_queue *queue);
+void *run_worker(void *arg);
+void reject_client(int s, int *spare_fd);
+void raise_fd_limit(int max_clients);
 
+/* Usage: multi-tcpserver [-w workers] [-q queue_depth] port
+ * Connections are served by a fixed pool of worker threads (16 by
+ * default), started once. The main thread only accepts: it hands each
+ * connection to the workers through a queue of queue_depth sockets (1024
+ * by default), so threads and memory stay bounded however many clients
+ * connect. When the queue is full, or the process runs out of descriptors,
+ * new connections are accepted and closed right away */
 int main(int argc, char **argv)
 {
+    int workers = DEFAULT_WORKERS;
+    int depth = DEFAULT_QUEUE_DEPTH;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w workers] [-q queue_depth] port\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     // check if the number of arguments is valid
-    if (argc != 2)
+    if (optind != argc - 1 || workers < 1 || depth < 1)
     {
         perror("ERROR: wrong argument numbers");
         exit(EXIT_FAILURE);
@@ -29,7 +85,7 @@ int main(int argc, char **argv)
     // check if the port number is valid
     int addr = inet_addr("127.0.0.1");
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     if (port < 1024 || port > 49151)
     {
         perror("ERROR: port number must be between 1024 and 49151");
@@ -40,11 +96,35 @@ int main(int argc, char **argv)
     struct sockaddr_in server_addr = configure_server_address(addr, port);
 
     int s = bind_and_listen(server_addr);
+    // a socket per worker and per queued connection
+    raise_fd_limit(workers + depth);
 
-    // create threads
-    pthread_t threads[MAX_THREADS];
+    struct connection_queue queue;
+    init_queue(&queue, depth);
 
-    int id = 0;
+    // start the workers; they run as long as the server does
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_t thread;
+        int error = pthread_create(&thread, &attr, run_worker, &queue);
+        if (error != 0)
+        {
+            fprintf(stderr, "ERROR: pthread_create failed: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // a descriptor kept open to be given up when accept runs out of them
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    // how long a worker waits for a client
+    struct timeval timeout = {CLIENT_TIMEOUT_S, 0};
+
+    // round-robin
     while (1)
     {
 
@@ -52,24 +132,24 @@ int main(int argc, char **argv)
         socklen_t len = sizeof(server_addr);
         if ((new_s = accept(s, (struct sockaddr *)&server_addr, &len)) < 0)
         {
-            perror("ERROR: accept failed");
-            // exit(EXIT_FAILURE);
+            // the connection stays pending until a descriptor is found for it
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                reject_client(s, &spare_fd);
+            }
+            else
+            {
+                perror("ERROR: accept failed");
+            }
+            continue;
         }
 
-        int *new_sock = malloc(sizeof(int));
-        *new_sock = new_s;
-
-        if (pthread_create(&threads[id], NULL, connect_to_server, (void *)new_sock) < 0)
-        {
-            perror("ERROR: pthread_create failed");
-            free(new_sock);
-        }
-        id++;
-        if (id == MAX_THREADS)
+        setsockopt(new_s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        // hand the connection to a worker
+        if (!enqueue_client(&queue, new_s))
         {
-            break;
+            close(new_s);
         }
-        // pthread_create(&threads[i], NULL, connect_to_server, args);
     }
 
     // close the socket
@@ -119,17 +199,20 @@ int bind_and_listen(struct sockaddr_in server_addr)
     };
     return s;
 }
-void *connect_to_server(void *arg)
-{
-
-    int new_s = *((int *)arg);
 
+/* Runs the handshake with one client on a worker thread and closes the
+ * connection. A client that fails or times out is dropped, so the worker
+ * can move on to the next one */
+void connect_to_server(int new_s)
+{
     char buf[MAX_LINE];
 
     // receive the message
     if ((receive_message(new_s, buf, sizeof(buf))) < 0)
     {
         perror("ERROR: receive failed");
+        close(new_s);
+        return;
     }
 
     fputs(buf, stdout);
@@ -157,12 +240,13 @@ void *connect_to_server(void *arg)
     if ((receive_message(new_s, buf, sizeof(buf))) < 0)
     {
         perror("ERROR: receive failed");
+        close(new_s);
+        return;
     }
 
     int next_sequence_number = atoi(buf + 6);
     if (next_sequence_number != sequence_number + 1)
     {
-        close(new_s);
         perror("ERROR: sequence number is not correct");
     }
 
@@ -175,15 +259,124 @@ void *connect_to_server(void *arg)
     {
         perror("ERROR: close failed");
     }
-    free(arg);
-    pthread_exit(NULL);
+}
+
+/* Starts an empty queue with room for depth sockets */
+void init_queue(struct connection_queue *queue, int depth)
+{
+    queue->sockets = malloc(depth * sizeof(int));
+    if (queue->sockets == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    queue->depth = depth;
+    queue->head = 0;
+    queue->count = 0;
+    queue->rejecting = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+}
+
+/* Queues an accepted socket for the workers without waiting. Returns 0,
+ * and reports the first of a run of rejections, when the queue is full */
+int enqueue_client(struct connection_queue *queue, int new_s)
+{
+    int queued = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count < queue->depth)
+    {
+        queue->sockets[(queue->head + queue->count) % queue->depth] = new_s;
+        queue->count++;
+        queue->rejecting = 0;
+        queued = 1;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    else if (!queue->rejecting)
+    {
+        fprintf(stderr, "ERROR: rejecting new connections, %d are queued\n", queue->count);
+        queue->rejecting = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return queued;
+}
+
+/* Takes the oldest queued socket, waiting for one if there is none */
+int dequeue_client(struct connection_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+    {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    int new_s = queue->sockets[queue->head];
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return new_s;
+}
+
+/* A worker: serves queued connections one after the other, forever */
+void *run_worker(void *arg)
+{
+    struct connection_queue *queue = arg;
+
+    while (1)
+    {
+        connect_to_server(dequeue_client(queue));
+    }
+    return NULL;
+}
+
+/* Turns away a pending connection when no descriptor is left to accept
+ * it: the spare descriptor is closed to make room, the connection is
+ * accepted and closed, and the spare is opened again */
+void reject_client(int s, int *spare_fd)
+{
+    if (*spare_fd < 0)
+    {
+        perror("ERROR: accept failed");
+        return;
+    }
+    close(*spare_fd);
+    int new_s = accept(s, NULL, NULL);
+    if (new_s >= 0)
+    {
+        fprintf(stderr, "ERROR: out of descriptors, connection rejected\n");
+        close(new_s);
+    }
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Raises the soft limit on open descriptors so that max_clients
+ * connections fit, as far as the hard limit allows */
+void raise_fd_limit(int max_clients)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        return;
+    }
+    // the listener, the spare and the standard streams
+    rlim_t wanted = (rlim_t)max_clients + 16;
+    if (limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        perror("ERROR: setrlimit failed");
+    }
 }
 
 int receive_message(int s, char *message, size_t size)
 {
-    // receive the message
-    int bytes_received = recv(s, message, size, 0);
-    if (bytes_received < 0)
+    // receive the message, leaving room for the terminator
+    int bytes_received = recv(s, message, size - 1, 0);
+    // a closed connection counts as a failure too
+    if (bytes_received <= 0)
     {
         return -1;
     }
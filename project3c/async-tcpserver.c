@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/types.h>
@@ -12,7 +13,11 @@
 
 #define MAX_PENDING 10
 #define MAX_LINE 20
-#define MAX_THREADS 100
+// select watches descriptors below FD_SETSIZE only, which also caps the
+// connections served at once; -c may lower the cap
+#define MAX_CLIENTS (FD_SETSIZE - 8)
+// slots are allocated this many at a time, as connections arrive
+#define CLIENT_CHUNK 128
 
 #define CLOSED 0
 #define SYN_SENT 1
@@ -24,19 +29,67 @@ struct client_state
     int phase;
     int sequence_number;
     char *buf;
+    // next unused slot while this one is on the free list
+    struct client_state *next_free;
+};
+
+// the connection slots. Unused slots are chained into a free list, so
+// accepting takes no search, and each socket maps straight to its slot
+// through by_fd, so a ready descriptor needs no search either. Slots come
+// in chunks of CLIENT_CHUNK that are added when the free list runs out
+struct client_table
+{
+    struct client_state **chunks;
+    int nchunks;
+    // slots allocated, in use, and the most that may be
+    int capacity;
+    int count;
+    int max_clients;
+    struct client_state *free_list;
+    struct client_state *by_fd[FD_SETSIZE];
+    // a descriptor kept open to be given up when accept runs out of them
+    int spare_fd;
+    // set while new connections are being turned away
+    int rejecting;
 };
 
 int bind_and_listen(struct sockaddr_in server_addr);
 struct sockaddr_in configure_server_address(int addr, int port);
 
-void handle_first_shake(struct client_state *client);
-void handle_second_shake(struct client_state *client);
+void init_client_table(struct client_table *table, int max_clients);
+void grow_client_table(struct client_table *table);
+void reject_client(int listener_fd, struct client_table *table);
+void note_rejection(struct client_table *table);
+struct client_state *open_client(struct client_table *table, int socket);
+void close_client(struct client_table *table, struct client_state *client);
+
+void handle_first_shake(struct client_table *table, struct client_state *client);
+void handle_second_shake(struct client_table *table, struct client_state *client);
 void print_buf(char *buf);
 
+/* Usage: async-tcpserver [-c max_clients] port
+ * -c caps the connections served at once, at most FD_SETSIZE - 8 (the
+ * default). The connection table grows as clients arrive up to the cap;
+ * past it, or when the process runs out of descriptors, new connections
+ * are accepted and closed right away */
 int main(int argc, char **argv)
 {
+    int max_clients = MAX_CLIENTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c max_clients] port\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     // check if the number of arguments is valid
-    if (argc != 2)
+    if (optind != argc - 1 || max_clients < 1 || max_clients > MAX_CLIENTS)
     {
         perror("ERROR: wrong argument numbers");
         exit(EXIT_FAILURE);
@@ -44,7 +97,7 @@ int main(int argc, char **argv)
 
     int addr = inet_addr("127.0.0.1");
     // convert the input to an integer
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     // check if the port number is valid
     if (port < 1024 || port > 49151)
     {
@@ -58,7 +111,8 @@ int main(int argc, char **argv)
     // bind the socket and listen for incoming connections
     int listener_fd = bind_and_listen(server_addr);
 
-    struct client_state client_states[MAX_THREADS];
+    struct client_table table;
+    init_client_table(&table, max_clients);
     // file descriptor set for the listener and the clients
     fd_set all_set;
     fd_set read_set;
@@ -69,18 +123,9 @@ int main(int argc, char **argv)
     FD_ZERO(&all_set);
     // add the listener to the all_set
     FD_SET(listener_fd, &all_set);
-    // set the client_states array
-    for (int i = 0; i < MAX_THREADS; i++)
-    {
-        client_states[i].socket = -1;
-        client_states[i].phase = CLOSED;
-        client_states[i].buf = NULL;
-    }
-
-    time_out.tv_usec = 100000;
-    time_out.tv_sec = 0;
 
-    // track the maximum file descriptor
+    // track the maximum file descriptor: raised on accept, lowered on close
+    // past the descriptors that are no longer in the set
     int max_fd = listener_fd;
 
     // round-robin
@@ -88,14 +133,9 @@ int main(int argc, char **argv)
     {
         // copy the all_set to read_set
         read_set = all_set;
-        // find the maximum file descriptor
-        for (int i = 0; i < MAX_THREADS; i++)
-        {
-            if (client_states[i].socket > 0)
-            {
-                max_fd = client_states[i].socket > max_fd ? client_states[i].socket : max_fd;
-            }
-        }
+        // select may change the timeout, so set it every time
+        time_out.tv_usec = 100000;
+        time_out.tv_sec = 0;
         // wait for an event, check if the listener or any of the clients are ready to read
         select_retval = select(max_fd + 1, &read_set, NULL, NULL, &time_out);
         // no event
@@ -106,77 +146,73 @@ int main(int argc, char **argv)
         // error
         else if (select_retval < 0)
         {
-            perror("ERROR: select failed");
+            if (errno != EINTR)
+            {
+                perror("ERROR: select failed");
+            }
+            continue;
         }
-        // there is an event
-        else
+
+        // check if there is a new connection
+        if (FD_ISSET(listener_fd, &read_set))
         {
-            // check if there is a new connection
-            if (FD_ISSET(listener_fd, &read_set))
+            select_retval--;
+            // accept the connection, store the socket
+            int s = accept(listener_fd, NULL, NULL);
+            // check if the accept failed; without a descriptor for it the
+            // connection would stay pending and keep the listener ready
+            if (s < 0 && (errno == EMFILE || errno == ENFILE))
             {
-                // find an empty slot in the client_states array
-                for (int i = 0; i < MAX_THREADS; i++)
-                {
-                    if (client_states[i].socket < 0)
-                    {
-                        socklen_t len = sizeof(server_addr);
-                        // accept the connection, store the socket
-                        client_states[i].socket = accept(listener_fd, (struct sockaddr *)&server_addr, &len);
-                        // check if the accept failed
-                        if (client_states[i].socket < 0)
-                        {
-                            perror("ERROR: accept failed");
-                        }
-                        // accept the connection, add the socket to the all_set
-                        FD_SET(client_states[i].socket, &all_set);
-                        // set the socket to non-blocking
-                        fcntl(client_states[i].socket, F_SETFL, O_NONBLOCK);
-                        // set the phase to 1, for TCP handshake this is the SYN_SENT state
-                        client_states[i].phase = SYN_SENT;
-                        // allocate memory for the buffer
-                        client_states[i].buf = (char *)malloc(MAX_LINE);
-                        // check if the malloc failed
-                        if (client_states[i].buf == NULL)
-                        {
-                            perror("ERROR: malloc failed");
-                            exit(EXIT_FAILURE);
-                        }
-                        // update the maximum file descriptor
-                        max_fd = client_states[i].socket > max_fd ? client_states[i].socket : max_fd;
-                        break;
-                    }
-                }
+                reject_client(listener_fd, &table);
+            }
+            else if (s < 0)
+            {
+                perror("ERROR: accept failed");
+            }
+            // select cannot watch descriptors past FD_SETSIZE
+            else if (s >= FD_SETSIZE || open_client(&table, s) == NULL)
+            {
+                note_rejection(&table);
+                close(s);
             }
-
             else
             {
-                // check if any of the clients are ready to read
-                for (int i = 0; i < MAX_THREADS; i++)
+                // accept the connection, add the socket to the all_set
+                FD_SET(s, &all_set);
+                // set the socket to non-blocking
+                fcntl(s, F_SETFL, O_NONBLOCK);
+                // update the maximum file descriptor
+                max_fd = s > max_fd ? s : max_fd;
+            }
+        }
+
+        // check which of the clients are ready to read, stopping after the
+        // last ready descriptor
+        for (int fd = 0; fd <= max_fd && select_retval > 0; fd++)
+        {
+            struct client_state *client = table.by_fd[fd];
+            if (client == NULL || !FD_ISSET(fd, &read_set))
+            {
+                continue;
+            }
+            select_retval--;
+
+            switch (client->phase)
+            {
+            case SYN_SENT:
+                handle_first_shake(&table, client);
+                break;
+            case ESTABLISHED:
+                handle_second_shake(&table, client);
+                break;
+            }
+            // the handler closed the connection
+            if (table.by_fd[fd] == NULL)
+            {
+                FD_CLR(fd, &all_set);
+                while (max_fd > listener_fd && !FD_ISSET(max_fd, &all_set))
                 {
-                    if (client_states[i].socket < 0)
-                    {
-                        continue;
-                    }
-                    // check if the client is ready to read
-                    if (FD_ISSET(client_states[i].socket, &read_set))
-                    {
-                        // continue if the socket is closed
-                        if (client_states[i].socket < 0)
-                        {
-                            continue;
-                        }
-
-                        switch (client_states[i].phase)
-                        {
-                        case SYN_SENT:
-                            handle_first_shake(&client_states[i]);
-                            break;
-                        case ESTABLISHED:
-                            handle_second_shake(&client_states[i]);
-                            FD_CLR(client_states[i].socket, &all_set);
-                            break;
-                        }
-                    }
+                    max_fd--;
                 }
             }
         }
@@ -231,16 +267,146 @@ int bind_and_listen(struct sockaddr_in server_addr)
     return s;
 }
 
-void handle_first_shake(struct client_state *client)
+/* Starts an empty table for up to max_clients connections */
+void init_client_table(struct client_table *table, int max_clients)
+{
+    table->chunks = NULL;
+    table->nchunks = 0;
+    table->capacity = 0;
+    table->count = 0;
+    table->max_clients = max_clients;
+    table->free_list = NULL;
+    for (int fd = 0; fd < FD_SETSIZE; fd++)
+    {
+        table->by_fd[fd] = NULL;
+    }
+    table->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    table->rejecting = 0;
+}
+
+/* Adds a chunk of unused slots to the free list, or as many as are left
+ * below the cap */
+void grow_client_table(struct client_table *table)
+{
+    int size = table->max_clients - table->capacity;
+    size = size < CLIENT_CHUNK ? size : CLIENT_CHUNK;
+
+    struct client_state **chunks = realloc(table->chunks, (table->nchunks + 1) * sizeof(*chunks));
+    struct client_state *chunk = malloc(size * sizeof(*chunk));
+    if (chunks == NULL || chunk == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    table->chunks = chunks;
+    table->chunks[table->nchunks++] = chunk;
+    table->capacity += size;
+
+    for (int i = size - 1; i >= 0; i--)
+    {
+        chunk[i].socket = -1;
+        chunk[i].phase = CLOSED;
+        chunk[i].buf = NULL;
+        chunk[i].next_free = table->free_list;
+        table->free_list = &chunk[i];
+    }
+}
+
+/* Turns away a pending connection when no descriptor is left to accept
+ * it: the spare descriptor is closed to make room, the connection is
+ * accepted and closed, and the spare is opened again */
+void reject_client(int listener_fd, struct client_table *table)
+{
+    if (table->spare_fd < 0)
+    {
+        perror("ERROR: accept failed");
+        return;
+    }
+    close(table->spare_fd);
+    int s = accept(listener_fd, NULL, NULL);
+    if (s >= 0)
+    {
+        note_rejection(table);
+        close(s);
+    }
+    table->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Reports the first of a run of rejected connections */
+void note_rejection(struct client_table *table)
+{
+    if (!table->rejecting)
+    {
+        fprintf(stderr, "ERROR: rejecting new connections, %d are open\n", table->count);
+        table->rejecting = 1;
+    }
+}
+
+/* Takes a slot off the free list for a new connection, growing the table
+ * when the list is empty. Returns NULL when max_clients connections are
+ * already open */
+struct client_state *open_client(struct client_table *table, int socket)
+{
+    if (table->free_list == NULL && table->capacity < table->max_clients)
+    {
+        grow_client_table(table);
+    }
+    struct client_state *client = table->free_list;
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    // allocate memory for the buffer
+    client->buf = (char *)malloc(MAX_LINE);
+    // check if the malloc failed
+    if (client->buf == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    table->free_list = client->next_free;
+    table->count++;
+    table->rejecting = 0;
+    table->by_fd[socket] = client;
+    client->socket = socket;
+    // set the phase to 1, for TCP handshake this is the SYN_SENT state
+    client->phase = SYN_SENT;
+    return client;
+}
+
+/* Closes a connection and puts its slot back on the free list */
+void close_client(struct client_table *table, struct client_state *client)
+{
+    if (close(client->socket) < 0)
+    {
+        perror("ERROR: close failed");
+    }
+    free(client->buf);
+    table->by_fd[client->socket] = NULL;
+    client->socket = -1;
+    client->phase = CLOSED;
+    client->buf = NULL;
+    client->next_free = table->free_list;
+    table->free_list = client;
+    table->count--;
+}
+
+void handle_first_shake(struct client_table *table, struct client_state *client)
 {
     int s = client->socket;
     char *buf = client->buf;
 
-    // receive the message
-    int bytes_received = recv(s, buf, MAX_LINE, 0);
-    if (bytes_received < 0)
+    // receive the message, leaving room for the terminator
+    int bytes_received = recv(s, buf, MAX_LINE - 1, 0);
+    if (bytes_received <= 0)
     {
-        perror("ERROR: receive failed");
+        // the peer went away, or the socket failed: free the slot
+        if (bytes_received < 0)
+        {
+            perror("ERROR: receive failed");
+        }
+        close_client(table, client);
+        return;
     }
     // null terminate the message
     buf[bytes_received] = '\0';
@@ -268,17 +434,23 @@ void handle_first_shake(struct client_state *client)
     client->sequence_number = sequence_number;
 }
 
-void handle_second_shake(struct client_state *client)
+void handle_second_shake(struct client_table *table, struct client_state *client)
 {
     int sequence_number = client->sequence_number;
     int s = client->socket;
     char *buf = client->buf;
 
-    // receive the message
-    int bytes_received = recv(s, buf, MAX_LINE, 0);
-    if (bytes_received < 0)
+    // receive the message, leaving room for the terminator
+    int bytes_received = recv(s, buf, MAX_LINE - 1, 0);
+    if (bytes_received <= 0)
     {
-        perror("ERROR: receive failed");
+        // the peer went away, or the socket failed: free the slot
+        if (bytes_received < 0)
+        {
+            perror("ERROR: receive failed");
+        }
+        close_client(table, client);
+        return;
     }
     // null terminate the message
     buf[bytes_received] = '\0';
@@ -287,19 +459,12 @@ void handle_second_shake(struct client_state *client)
     int next_sequence_number = atoi(buf + 6);
     if (next_sequence_number != sequence_number + 1)
     {
-        close(s);
         perror("ERROR: sequence number is not correct");
     }
 
     print_buf(buf);
 
-    free(client->buf);
-    client->phase = CLOSED;
-    client->buf = NULL;
-    if (close(s) < 0)
-    {
-        perror("ERROR: close failed");
-    }
+    close_client(table, client);
 }
 
 void print_buf(char *buf)
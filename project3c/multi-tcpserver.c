@@ -2,7 +2,10 @@
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -10,18 +13,48 @@
 
 #define MAX_PENDING 10
 #define MAX_LINE 20
-#define MAX_THREADS 100
+// connections served at once, unless -c says otherwise
+#define DEFAULT_MAX_CLIENTS 100000
+// a connection thread needs little stack; the default would reserve
+// megabytes of address space for each of them
+#define CLIENT_STACK_SIZE (64 * 1024)
+
+// connection threads running, shared with the threads themselves
+int active_clients = 0;
+pthread_mutex_t active_clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int send_message(int s, char *message, size_t size);
 int receive_message(int s, char *message, size_t size);
 void *connect_to_server(void *arg);
 int bind_and_listen(struct sockaddr_in server_addr);
 struct sockaddr_in configure_server_address(int addr, int port);
+int reserve_client(int max_clients);
+void release_client();
+void reject_client(int s, int *spare_fd);
+void raise_fd_limit(int max_clients);
 
+/* Usage: multi-tcpserver [-c max_clients] port
+ * Every connection is served by a thread of its own. -c caps the threads
+ * running at once (100000 by default); past it, or when the process runs
+ * out of descriptors, new connections are accepted and closed right away */
 int main(int argc, char **argv)
 {
+    int max_clients = DEFAULT_MAX_CLIENTS;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c max_clients] port\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     // check if the number of arguments is valid
-    if (argc != 2)
+    if (optind != argc - 1 || max_clients < 1)
     {
         perror("ERROR: wrong argument numbers");
         exit(EXIT_FAILURE);
@@ -29,7 +62,7 @@ int main(int argc, char **argv)
     // check if the port number is valid
     int addr = inet_addr("127.0.0.1");
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     if (port < 1024 || port > 49151)
     {
         perror("ERROR: port number must be between 1024 and 49151");
@@ -40,11 +73,17 @@ int main(int argc, char **argv)
     struct sockaddr_in server_addr = configure_server_address(addr, port);
 
     int s = bind_and_listen(server_addr);
+    raise_fd_limit(max_clients);
 
-    // create threads
-    pthread_t threads[MAX_THREADS];
+    // threads are detached: nothing joins them, they clean up as they exit
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+
+    // a descriptor kept open to be given up when accept runs out of them
+    int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    int id = 0;
     // round-robin
     while (1)
     {
@@ -53,25 +92,36 @@ int main(int argc, char **argv)
         socklen_t len = sizeof(server_addr);
         if ((new_s = accept(s, (struct sockaddr *)&server_addr, &len)) < 0)
         {
-            perror("ERROR: accept failed");
-            // exit(EXIT_FAILURE);
+            // the connection stays pending until a descriptor is found for it
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                reject_client(s, &spare_fd);
+            }
+            else
+            {
+                perror("ERROR: accept failed");
+            }
+            continue;
+        }
+
+        if (!reserve_client(max_clients))
+        {
+            close(new_s);
+            continue;
         }
 
         int *new_sock = malloc(sizeof(int));
         *new_sock = new_s;
         // create a new thread
-        if (pthread_create(&threads[id], NULL, connect_to_server, (void *)new_sock) < 0)
+        pthread_t thread;
+        int error = pthread_create(&thread, &attr, connect_to_server, (void *)new_sock);
+        if (error != 0)
         {
-            perror("ERROR: pthread_create failed");
+            fprintf(stderr, "ERROR: pthread_create failed: %s\n", strerror(error));
+            close(new_s);
             free(new_sock);
+            release_client();
         }
-
-        id++;
-        if (id == MAX_THREADS)
-        {
-            break;
-        }
-        // pthread_create(&threads[i], NULL, connect_to_server, args);
     }
 
     // close the socket
@@ -164,7 +214,6 @@ void *connect_to_server(void *arg)
     int next_sequence_number = atoi(buf + 6);
     if (next_sequence_number != sequence_number + 1)
     {
-        close(new_s);
         perror("ERROR: sequence number is not correct");
     }
 
@@ -178,9 +227,83 @@ void *connect_to_server(void *arg)
         perror("ERROR: close failed");
     }
     free(arg);
+    release_client();
     pthread_exit(NULL);
 }
 
+/* Counts a new connection thread. Returns 0, and reports the first of a
+ * run of rejections, when max_clients are running already */
+int reserve_client(int max_clients)
+{
+    static int rejecting = 0;
+    int reserved = 0;
+
+    pthread_mutex_lock(&active_clients_lock);
+    if (active_clients < max_clients)
+    {
+        active_clients++;
+        reserved = 1;
+        rejecting = 0;
+    }
+    else if (!rejecting)
+    {
+        fprintf(stderr, "ERROR: rejecting new connections, %d are open\n", active_clients);
+        rejecting = 1;
+    }
+    pthread_mutex_unlock(&active_clients_lock);
+    return reserved;
+}
+
+/* Counts a connection thread out */
+void release_client()
+{
+    pthread_mutex_lock(&active_clients_lock);
+    active_clients--;
+    pthread_mutex_unlock(&active_clients_lock);
+}
+
+/* Turns away a pending connection when no descriptor is left to accept
+ * it: the spare descriptor is closed to make room, the connection is
+ * accepted and closed, and the spare is opened again */
+void reject_client(int s, int *spare_fd)
+{
+    if (*spare_fd < 0)
+    {
+        perror("ERROR: accept failed");
+        return;
+    }
+    close(*spare_fd);
+    int new_s = accept(s, NULL, NULL);
+    if (new_s >= 0)
+    {
+        fprintf(stderr, "ERROR: out of descriptors, connection rejected\n");
+        close(new_s);
+    }
+    *spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* Raises the soft limit on open descriptors so that max_clients
+ * connections fit, as far as the hard limit allows */
+void raise_fd_limit(int max_clients)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        return;
+    }
+    // the listener, the spare and the standard streams
+    rlim_t wanted = (rlim_t)max_clients + 16;
+    if (limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        perror("ERROR: setrlimit failed");
+    }
+}
+
 int receive_message(int s, char *message, size_t size)
 {
     // receive the message
@@ -1,50 +1,197 @@
+// for SO_REUSEPORT and the CPU affinity calls
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
-#define MAX_PENDING 10
+// accepts come in bursts from many clients at once
+#define MAX_PENDING SOMAXCONN
 #define MAX_LINE 20
-#define MAX_THREADS 100
+// events taken from epoll_wait at a time
+#define MAX_EVENTS 100
+
+// connections served at once, unless -c says otherwise
+#define DEFAULT_MAX_CLIENTS 100000
+// slots are allocated this many at a time, as connections arrive
+#define CLIENT_CHUNK 1024
 
 #define CLOSED 0
 #define SYN_SENT 1
 #define ESTABLISHED 2
 
+// connections idle for this long are closed, unless -i says otherwise
+#define DEFAULT_IDLE_TIMEOUT_MS 30000
+
 struct client_state
 {
     int socket;
     int phase;
     int sequence_number;
     char *buf;
+    // CLOCK_MONOTONIC time of the last event on the socket, in milliseconds
+    long long last_active;
+    // next unused slot while this one is on the free list
+    struct client_state *next_free;
 };
 
-int bind_and_listen(struct sockaddr_in server_addr);
+// the connection slots. Each socket is registered with epoll along with a
+// pointer to its slot, so an event leads straight to its connection, and
+// unused slots are chained into a free list, so accepting takes no search.
+// Slots come in chunks of CLIENT_CHUNK that are added when the free list
+// runs out and never move, so the pointers epoll holds stay valid
+struct client_table
+{
+    struct client_state **chunks;
+    int nchunks;
+    // slots allocated, in use, and the most that may be
+    int capacity;
+    int count;
+    int max_clients;
+    struct client_state *free_list;
+    // a descriptor kept open to be given up when accept runs out of them
+    int spare_fd;
+    // set while new connections are being turned away
+    int rejecting;
+};
+
+// adaptive busy-polling: after a batch of events the loop keeps calling
+// epoll_wait without blocking for up to window_us microseconds. The window
+// doubles, up to max_us, whenever spinning catches new events, and halves
+// whenever it runs dry, so a server that goes idle soon blocks right away
+struct busy_poll
+{
+    int max_us;
+    int window_us;
+};
+
+// one event loop and everything it uses: its own listener, epoll set,
+// timer and connection table. Reactors share nothing while serving, the
+// kernel spreads new connections across their SO_REUSEPORT listeners
+struct reactor
+{
+    int listener_fd;
+    int epoll_fd;
+    // the housekeeping timer, -1 when idle connections are kept
+    int timer_fd;
+    int idle_timeout_ms;
+    // CPU the loop is pinned to, -1 to leave it to the scheduler
+    int cpu;
+    struct busy_poll poll;
+    struct client_table table;
+};
+
+int bind_and_listen(struct sockaddr_in server_addr, int reuse_port);
 struct sockaddr_in configure_server_address(int addr, int port);
 
-void handle_first_shake(struct client_state *client);
-void handle_second_shake(struct client_state *client);
+struct reactor *create_reactor(struct sockaddr_in server_addr, int reuse_port, int max_clients,
+                               int idle_timeout_ms, struct busy_poll poll, int cpu);
+void *run_reactor(void *arg);
+int count_cpus();
+int pick_cpu(int index);
+
+int wait_for_events(int epoll_fd, struct epoll_event *events, int max_events, struct busy_poll *poll);
+void accept_clients(int listener_fd, int epoll_fd, struct client_table *table, long long now);
+int arm_housekeeping_timer(int idle_timeout_ms);
+void reap_idle_clients(int timer_fd, struct client_table *table, long long now, int idle_timeout_ms);
+void init_client_table(struct client_table *table, int max_clients);
+void grow_client_table(struct client_table *table);
+int reject_client(int listener_fd, struct client_table *table);
+void note_rejection(struct client_table *table);
+struct client_state *open_client(struct client_table *table, int socket, long long now);
+void close_client(struct client_table *table, struct client_state *client);
+void raise_fd_limit(int max_clients, int nreactors);
+long long monotonic_ms();
+
+void handle_first_shake(struct client_table *table, struct client_state *client);
+void handle_second_shake(struct client_table *table, struct client_state *client);
 void print_buf(char *buf);
 
+/* Usage: epoll-tcpserver [-i idle_ms] [-b busy_poll_us] [-c max_clients]
+ *                        [-t threads] [-a] port
+ * The server blocks in epoll_wait until a connection or a client message
+ * arrives, so it uses no CPU while idle. A timerfd in the same epoll set
+ * wakes it up for housekeeping: connections that have been idle for idle_ms
+ * milliseconds (30000 by default, 0 to keep them forever) are closed.
+ *
+ * -b trades CPU for latency: after handling events the loop spins on
+ * epoll_wait for up to busy_poll_us microseconds before it blocks again, so
+ * a message that arrives shortly after the last one is picked up without
+ * the wakeup of a blocked thread. Off by default
+ *
+ * -c caps the connections served at once (100000 by default). The
+ * connection table grows as clients arrive up to the cap; past it, or when
+ * the process runs out of descriptors, new connections are accepted and
+ * closed right away
+ *
+ * -t runs that many event loops, each in a thread of its own with its own
+ * listener on the port, 0 for one per CPU the server may run on; one loop
+ * by default. The kernel balances new connections across the listeners and
+ * each loop serves its connections alone, with an even share of the -c
+ * cap. -a pins every loop to a CPU of its own */
 int main(int argc, char **argv)
 {
+    int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    struct busy_poll poll = {0, 0};
+    int max_clients = DEFAULT_MAX_CLIENTS;
+    int nreactors = 1;
+    int pin = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:b:c:t:a")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            idle_timeout_ms = atoi(optarg);
+            break;
+        case 'b':
+            poll.max_us = atoi(optarg);
+            poll.window_us = poll.max_us;
+            break;
+        case 'c':
+            max_clients = atoi(optarg);
+            break;
+        case 't':
+            nreactors = atoi(optarg);
+            break;
+        case 'a':
+            pin = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "usage: %s [-i idle_ms] [-b busy_poll_us] [-c max_clients] [-t threads] [-a] port\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     // check if the number of arguments is valid
-    if (argc != 2)
+    if (optind != argc - 1 || idle_timeout_ms < 0 || poll.max_us < 0 || max_clients < 1 ||
+        nreactors < 0)
     {
         perror("ERROR: wrong argument numbers");
         exit(EXIT_FAILURE);
     }
+    if (nreactors == 0)
+    {
+        nreactors = count_cpus();
+    }
 
     int addr = inet_addr("127.0.0.1");
     // convert the input to an integer
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     // check if the port number is valid
     if (port < 1024 || port > 49151)
     {
@@ -55,121 +202,472 @@ int main(int argc, char **argv)
     port = htons(port);
     // configure the server address
     struct sockaddr_in server_addr = configure_server_address(addr, port);
-    // bind the socket and listen for incoming connections
-    int listener_fd = bind_and_listen(server_addr);
 
-    struct client_state client_states[MAX_THREADS];
+    raise_fd_limit(max_clients, nreactors);
+    // every listener is bound before any loop starts, so a port in use
+    // stops the server before it serves anything
+    struct reactor **reactors = malloc(nreactors * sizeof(*reactors));
+    if (reactors == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nreactors; i++)
+    {
+        reactors[i] = create_reactor(server_addr, nreactors > 1,
+                                     (max_clients + nreactors - 1) / nreactors, idle_timeout_ms,
+                                     poll, pin ? pick_cpu(i) : -1);
+    }
 
-    struct epoll_event ev, events[MAX_THREADS];
-    int epoll_fd = epoll_create1(0);
+    // the first loop runs on the main thread
+    for (int i = 1; i < nreactors; i++)
+    {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, run_reactor, reactors[i]);
+        if (error != 0)
+        {
+            fprintf(stderr, "ERROR: pthread_create failed: %s\n", strerror(error));
+            exit(EXIT_FAILURE);
+        }
+    }
+    run_reactor(reactors[0]);
+
+    return 0;
+}
+
+/* Sets up an event loop: binds its listener, creates its epoll set and
+ * timer and starts its empty connection table. The reactor gets its own
+ * cache-line-aligned allocation, so loops on different CPUs never write to
+ * the same line */
+struct reactor *create_reactor(struct sockaddr_in server_addr, int reuse_port, int max_clients,
+                               int idle_timeout_ms, struct busy_poll poll, int cpu)
+{
+    struct reactor *reactor;
+    if (posix_memalign((void **)&reactor, 64, (sizeof(*reactor) + 63) & ~(size_t)63) != 0)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    reactor->idle_timeout_ms = idle_timeout_ms;
+    reactor->poll = poll;
+    reactor->cpu = cpu;
+    init_client_table(&reactor->table, max_clients);
+
+    // bind the socket and listen for incoming connections
+    reactor->listener_fd = bind_and_listen(server_addr, reuse_port);
+    // edge-triggered: every readiness event is drained until accept would block
+    fcntl(reactor->listener_fd, F_SETFL, O_NONBLOCK);
 
-    if (epoll_fd == -1)
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd == -1)
     {
         perror("ERROR: epoll_create1 failed");
         exit(EXIT_FAILURE);
     }
-    // edge-triggered
+    // edge-triggered. Client events carry a pointer to their slot, the
+    // listener and the timer are told apart by pointers to their fds
+    struct epoll_event ev;
     ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = listener_fd;
-
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener_fd, &ev) == -1)
+    ev.data.ptr = &reactor->listener_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listener_fd, &ev) == -1)
     {
         perror("ERROR: epoll_ctl failed");
         exit(EXIT_FAILURE);
     }
 
-    // set the client_states array
-    for (int i = 0; i < MAX_THREADS; i++)
+    reactor->timer_fd = -1;
+    if (idle_timeout_ms > 0)
+    {
+        reactor->timer_fd = arm_housekeeping_timer(idle_timeout_ms);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &reactor->timer_fd;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &ev) == -1)
+        {
+            perror("ERROR: epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return reactor;
+}
+
+/* The event loop: sleeps in epoll_wait until there is work. Never returns */
+void *run_reactor(void *arg)
+{
+    struct reactor *reactor = arg;
+    struct client_table *table = &reactor->table;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (reactor->cpu >= 0)
     {
-        client_states[i].socket = -1;
-        client_states[i].phase = CLOSED;
-        client_states[i].buf = NULL;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor->cpu, &cpus);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (error != 0)
+        {
+            fprintf(stderr, "ERROR: pthread_setaffinity_np failed: %s\n", strerror(error));
+        }
     }
 
-    // round-robin
     while (1)
     {
-        int nfds = epoll_wait(epoll_fd, events, MAX_THREADS, 0);
+        int nfds = wait_for_events(reactor->epoll_fd, events, MAX_EVENTS, &reactor->poll);
 
         if (nfds == -1)
         {
-            perror("ERROR: epoll_wait failed");
+            if (errno != EINTR)
+            {
+                perror("ERROR: epoll_wait failed");
+            }
             continue;
         }
+        // one clock read per batch of events
+        long long now = monotonic_ms();
 
         for (int n = 0; n < nfds; n++)
         {
-            if (events[n].data.fd == listener_fd)
+            if (events[n].data.ptr == &reactor->listener_fd)
+            {
+                accept_clients(reactor->listener_fd, reactor->epoll_fd, table, now);
+                continue;
+            }
+            if (events[n].data.ptr == &reactor->timer_fd)
             {
-                for (int i = 0; i < MAX_THREADS; i++)
-                {
-                    if (client_states[i].socket < 0)
-                    {
-                        socklen_t len = sizeof(server_addr);
-                        client_states[i].socket = accept(listener_fd, (struct sockaddr *)&server_addr, &len);
-
-                        if (client_states[i].socket < 0)
-                        {
-                            perror("ERROR: accept failed");
-                        }
-
-                        ev.events = EPOLLIN | EPOLLET;
-                        ev.data.fd = client_states[i].socket;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_states[i].socket, &ev) == -1)
-                        {
-                            perror("ERROR: epoll_ctl failed");
-                            exit(EXIT_FAILURE);
-                        }
-
-                        fcntl(client_states[i].socket, F_SETFL, O_NONBLOCK);
-                        client_states[i].phase = SYN_SENT;
-                        client_states[i].buf = (char *)malloc(MAX_LINE);
-
-                        if (client_states[i].buf == NULL)
-                        {
-                            perror("ERROR: malloc failed");
-                            exit(EXIT_FAILURE);
-                        }
-                        break;
-                    }
-                }
+                reap_idle_clients(reactor->timer_fd, table, now, reactor->idle_timeout_ms);
+                continue;
             }
-            else
+
+            struct client_state *client = events[n].data.ptr;
+            // the connection was closed earlier in this batch
+            if (client->socket < 0)
             {
-                for (int i = 0; i < MAX_THREADS; i++)
-                {
-
-                    if (events[n].data.fd == client_states[i].socket)
-                    {
-                        if (client_states[i].socket < 0)
-                        {
-                            continue;
-                        }
-                        switch (client_states[i].phase)
-                        {
-                        case SYN_SENT:
-                            handle_first_shake(&client_states[i]);
-                            break;
-                        case ESTABLISHED:
-                            handle_second_shake(&client_states[i]);
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
+                continue;
+            }
+            client->last_active = now;
+            switch (client->phase)
+            {
+            case SYN_SENT:
+                handle_first_shake(table, client);
+                break;
+            case ESTABLISHED:
+                handle_second_shake(table, client);
+                break;
+            default:
+                break;
             }
         }
     }
 
-    // close the socket
-    if (close(listener_fd) < 0)
+    return NULL;
+}
+
+/* Returns the number of CPUs the server may run on */
+int count_cpus()
+{
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
     {
-        perror("ERROR: close failed");
+        return 1;
+    }
+    return CPU_COUNT(&cpus);
+}
+
+/* Returns the CPU for the loop with the given index: the index-th of the
+ * CPUs the server may run on, wrapping around when there are fewer */
+int pick_cpu(int index)
+{
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+    {
+        return -1;
+    }
+    index %= CPU_COUNT(&cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &cpus) && index-- == 0)
+        {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Waits for events, blocking in epoll_wait unless busy-polling is on. With
+ * busy-polling the loop first spins with a zero timeout for the current
+ * window and adapts the window to whether that caught anything */
+int wait_for_events(int epoll_fd, struct epoll_event *events, int max_events, struct busy_poll *poll)
+{
+    if (poll->window_us > 0)
+    {
+        struct timespec start;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+        {
+            int nfds = epoll_wait(epoll_fd, events, max_events, 0);
+            if (nfds != 0)
+            {
+                poll->window_us = poll->window_us * 2 < poll->max_us ? poll->window_us * 2 : poll->max_us;
+                return nfds;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 <
+                 poll->window_us);
+        poll->window_us /= 2;
+    }
+
+    int nfds = epoll_wait(epoll_fd, events, max_events, -1);
+    if (nfds > 0 && poll->max_us > 0 && poll->window_us == 0)
+    {
+        // traffic again after the window closed: start spinning briefly
+        poll->window_us = 1;
+    }
+    return nfds;
+}
+
+/* Accepts every pending connection into a free slot. The listener is
+ * edge-triggered, so it is drained until accept would block; connections
+ * that cannot be served are closed rather than left pending, since the
+ * listener would not report them again */
+void accept_clients(int listener_fd, int epoll_fd, struct client_table *table, long long now)
+{
+    while (1)
+    {
+        int s = accept(listener_fd, NULL, NULL);
+        if (s < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // accept reports a lack of descriptors even with none pending
+            if ((errno == EMFILE || errno == ENFILE) && reject_client(listener_fd, table))
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("ERROR: accept failed");
+            }
+            return;
+        }
+
+        struct client_state *client = open_client(table, s, now);
+        if (client == NULL)
+        {
+            // the table is full
+            note_rejection(table);
+            close(s);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s, &ev) == -1)
+        {
+            perror("ERROR: epoll_ctl failed");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(s, F_SETFL, O_NONBLOCK);
+    }
+}
+
+/* Creates the timerfd that wakes the event loop for housekeeping, firing
+ * every half idle timeout so that no connection stays open for more than
+ * one and a half times the timeout */
+int arm_housekeeping_timer(int idle_timeout_ms)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        perror("ERROR: timerfd_create failed");
         exit(EXIT_FAILURE);
     }
+    int period_ms = idle_timeout_ms / 2 > 0 ? idle_timeout_ms / 2 : 1;
+    struct itimerspec timer;
+    timer.it_interval.tv_sec = period_ms / 1000;
+    timer.it_interval.tv_nsec = (long)(period_ms % 1000) * 1000000;
+    timer.it_value = timer.it_interval;
+    if (timerfd_settime(timer_fd, 0, &timer, NULL) == -1)
+    {
+        perror("ERROR: timerfd_settime failed");
+        exit(EXIT_FAILURE);
+    }
+    return timer_fd;
+}
 
-    return 0;
+/* Housekeeping, run when the timer fires: closes every connection that has
+ * been idle for idle_timeout_ms or longer */
+void reap_idle_clients(int timer_fd, struct client_table *table, long long now, int idle_timeout_ms)
+{
+    // consume the expirations so the level-triggered timer goes quiet
+    unsigned long long expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    {
+        perror("ERROR: read timer failed");
+    }
+
+    for (int i = 0; i < table->capacity; i++)
+    {
+        struct client_state *client = &table->chunks[i / CLIENT_CHUNK][i % CLIENT_CHUNK];
+        if (client->socket >= 0 && now - client->last_active >= idle_timeout_ms)
+        {
+            close_client(table, client);
+        }
+    }
+}
+
+/* Starts an empty table for up to max_clients connections */
+void init_client_table(struct client_table *table, int max_clients)
+{
+    table->chunks = NULL;
+    table->nchunks = 0;
+    table->capacity = 0;
+    table->count = 0;
+    table->max_clients = max_clients;
+    table->free_list = NULL;
+    table->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    table->rejecting = 0;
+}
+
+/* Adds a chunk of unused slots to the free list, or as many as are left
+ * below the cap */
+void grow_client_table(struct client_table *table)
+{
+    int size = table->max_clients - table->capacity;
+    size = size < CLIENT_CHUNK ? size : CLIENT_CHUNK;
+
+    struct client_state **chunks = realloc(table->chunks, (table->nchunks + 1) * sizeof(*chunks));
+    struct client_state *chunk = malloc(size * sizeof(*chunk));
+    if (chunks == NULL || chunk == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    table->chunks = chunks;
+    table->chunks[table->nchunks++] = chunk;
+    table->capacity += size;
+
+    for (int i = size - 1; i >= 0; i--)
+    {
+        chunk[i].socket = -1;
+        chunk[i].phase = CLOSED;
+        chunk[i].buf = NULL;
+        chunk[i].next_free = table->free_list;
+        table->free_list = &chunk[i];
+    }
+}
+
+/* Turns away a pending connection when no descriptor is left to accept
+ * it: the spare descriptor is closed to make room, the connection is
+ * accepted and closed, and the spare is opened again. Returns 0 once no
+ * connection is pending */
+int reject_client(int listener_fd, struct client_table *table)
+{
+    if (table->spare_fd < 0)
+    {
+        perror("ERROR: accept failed");
+        return 0;
+    }
+    close(table->spare_fd);
+    int s = accept(listener_fd, NULL, NULL);
+    int pending = s >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    if (s >= 0)
+    {
+        note_rejection(table);
+        close(s);
+    }
+    table->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return pending;
+}
+
+/* Reports the first of a run of rejected connections */
+void note_rejection(struct client_table *table)
+{
+    if (!table->rejecting)
+    {
+        fprintf(stderr, "ERROR: rejecting new connections, %d are open\n", table->count);
+        table->rejecting = 1;
+    }
+}
+
+/* Takes a slot off the free list for a new connection, growing the table
+ * when the list is empty. Returns NULL when max_clients connections are
+ * already open */
+struct client_state *open_client(struct client_table *table, int socket, long long now)
+{
+    if (table->free_list == NULL && table->capacity < table->max_clients)
+    {
+        grow_client_table(table);
+    }
+    struct client_state *client = table->free_list;
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    client->buf = (char *)malloc(MAX_LINE);
+    if (client->buf == NULL)
+    {
+        perror("ERROR: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    table->free_list = client->next_free;
+    table->count++;
+    table->rejecting = 0;
+    client->socket = socket;
+    client->phase = SYN_SENT;
+    client->last_active = now;
+    return client;
+}
+
+/* Closes a connection and puts its slot back on the free list; closing the
+ * socket also removes it from the epoll set */
+void close_client(struct client_table *table, struct client_state *client)
+{
+    if (close(client->socket) < 0)
+    {
+        perror("ERROR: close failed");
+    }
+    free(client->buf);
+    client->socket = -1;
+    client->phase = CLOSED;
+    client->buf = NULL;
+    client->next_free = table->free_list;
+    table->free_list = client;
+    table->count--;
+}
+
+/* Raises the soft limit on open descriptors so that max_clients
+ * connections fit next to what nreactors loops hold, as far as the hard
+ * limit allows */
+void raise_fd_limit(int max_clients, int nreactors)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        return;
+    }
+    // every loop has its own listener, epoll, timer and spare; 16 more
+    // cover the standard streams
+    rlim_t wanted = (rlim_t)max_clients + 4 * (rlim_t)nreactors + 16;
+    if (limit.rlim_cur >= wanted)
+    {
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        perror("ERROR: setrlimit failed");
+    }
+}
+
+/* Returns the CLOCK_MONOTONIC time in milliseconds */
+long long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 struct sockaddr_in configure_server_address(int addr, int port)
@@ -182,7 +680,7 @@ struct sockaddr_in configure_server_address(int addr, int port)
     return server_addr;
 }
 
-int bind_and_listen(struct sockaddr_in server_addr)
+int bind_and_listen(struct sockaddr_in server_addr, int reuse_port)
 {
     // file descriptor for the server
     int s;
@@ -192,6 +690,13 @@ int bind_and_listen(struct sockaddr_in server_addr)
         perror("ERROR: socket failed");
         exit(EXIT_FAILURE);
     }
+    // let every event loop bind a listener of its own to the port
+    int on = 1;
+    if (reuse_port && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        perror("ERROR: setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
 
     // set all bits of the padding field to 0
     memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
@@ -211,16 +716,27 @@ int bind_and_listen(struct sockaddr_in server_addr)
     return s;
 }
 
-void handle_first_shake(struct client_state *client)
+void handle_first_shake(struct client_table *table, struct client_state *client)
 {
     int s = client->socket;
     char *buf = client->buf;
 
-    // receive the message
-    int bytes_received = recv(s, buf, MAX_LINE, 0);
-    if (bytes_received < 0)
+    // receive the message, leaving room for the terminator
+    int bytes_received = recv(s, buf, MAX_LINE - 1, 0);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // a stale event for a slot that was reused within the same batch
+        return;
+    }
+    if (bytes_received <= 0)
     {
-        perror("ERROR: receive failed");
+        // the peer went away, or the socket failed: free the slot
+        if (bytes_received < 0)
+        {
+            perror("ERROR: receive failed");
+        }
+        close_client(table, client);
+        return;
     }
     // null terminate the message
     buf[bytes_received] = '\0';
@@ -248,17 +764,28 @@ void handle_first_shake(struct client_state *client)
     client->sequence_number = sequence_number;
 }
 
-void handle_second_shake(struct client_state *client)
+void handle_second_shake(struct client_table *table, struct client_state *client)
 {
     int sequence_number = client->sequence_number;
     int s = client->socket;
     char *buf = client->buf;
 
-    // receive the message
-    int bytes_received = recv(s, buf, MAX_LINE, 0);
-    if (bytes_received < 0)
+    // receive the message, leaving room for the terminator
+    int bytes_received = recv(s, buf, MAX_LINE - 1, 0);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // a stale event for a slot that was reused within the same batch
+        return;
+    }
+    if (bytes_received <= 0)
     {
-        perror("ERROR: receive failed");
+        // the peer went away, or the socket failed: free the slot
+        if (bytes_received < 0)
+        {
+            perror("ERROR: receive failed");
+        }
+        close_client(table, client);
+        return;
     }
     // null terminate the message
     buf[bytes_received] = '\0';
@@ -267,25 +794,22 @@ void handle_second_shake(struct client_state *client)
     int next_sequence_number = atoi(buf + 6);
     if (next_sequence_number != sequence_number + 1)
     {
-        close(s);
         perror("ERROR: sequence number is not correct");
     }
 
     print_buf(buf);
 
-    free(client->buf);
-    client->phase = CLOSED;
-    client->buf = NULL;
-    if (close(s) < 0)
-    {
-        perror("ERROR: close failed");
-    }
+    close_client(table, client);
 }
 
 void print_buf(char *buf)
 {
-    fputs(buf, stdout);
-    fflush(stdout);
-    fputs("\n", stdout);
-    fflush(stdout);
+    // a single write per line, so loops on other threads neither interleave
+    // with it nor wait for the stdio lock
+    char line[MAX_LINE + 1];
+    int len = snprintf(line, sizeof(line), "%s\n", buf);
+    if (write(STDOUT_FILENO, line, len) < 0)
+    {
+        perror("ERROR: write failed");
+    }
 }
\ No newline at end of file